@@ -0,0 +1,134 @@
+#ifndef _BACKOFF_H
+#define _BACKOFF_H
+
+/* Backoff policies with budgets in nanoseconds.
+ *
+ * Counting pause instructions makes the wait depend on the CPU, one pause
+ * takes about 10 cycles on older cores and about 140 on Skylake and later.
+ * Here every wait spins on the TSC for a number of ticks converted from ns by
+ * backoff_configure, so the same setting means the same time on every host.
+ *
+ * BACKOFF_NONE     one pause, what the locks do without a policy
+ * BACKOFF_EXP      wait min_ns, doubling after each failed check up to max_ns
+ * BACKOFF_JITTER   like BACKOFF_EXP but each wait is uniform in [0, wait],
+ *                  so threads which failed together don't retry together
+ * BACKOFF_PROP     wait min_ns times the number of threads ahead, up to
+ *                  max_ns; locks not knowing the position count as one
+ *
+ * The policy is a single global shared by every lock in the program. Each
+ * wait episode keeps its state in a struct backoff, which must be reset with
+ * backoff_init before the first wait. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "tsc.h"
+
+enum backoff_kind {
+    BACKOFF_NONE,
+    BACKOFF_EXP,
+    BACKOFF_JITTER,
+    BACKOFF_PROP,
+};
+
+static const char *const backoff_names[] = { "none", "exp", "jitter", "prop" };
+
+struct backoff_policy {
+    enum backoff_kind kind;
+    uint64_t min;  /* TSC ticks. */
+    uint64_t max;
+};
+
+/* Weak so every object including this header shares one definition. */
+struct backoff_policy backoff_policy __attribute__((weak));
+
+struct backoff {
+    uint64_t wait; /* Ticks of the next wait, 0 before the first one. */
+    uint64_t rng;
+};
+
+/* Return -1 for an unknown name. */
+static inline int backoff_parse(const char *name)
+{
+    for (size_t i = 0; i < sizeof(backoff_names) / sizeof(backoff_names[0]); i++) {
+        if (strcmp(backoff_names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* tsc_per_ns as returned by tsc_calibrate. Not thread safe, call before
+ * starting threads. */
+static inline void backoff_configure(enum backoff_kind kind, uint64_t min_ns,
+        uint64_t max_ns, double tsc_per_ns)
+{
+    backoff_policy.kind = kind;
+    backoff_policy.min = min_ns * tsc_per_ns;
+    backoff_policy.max = max_ns * tsc_per_ns;
+    if (backoff_policy.min == 0)
+        backoff_policy.min = 1;
+    if (backoff_policy.max < backoff_policy.min)
+        backoff_policy.max = backoff_policy.min;
+}
+
+static inline void backoff_init(struct backoff *b)
+{
+    b->wait = 0;
+}
+
+static inline void backoff_spin(uint64_t ticks)
+{
+    uint64_t end = rdtsc() + ticks;
+
+    do {
+        asm volatile("pause\n": : :"memory");
+    } while (rdtsc() < end);
+}
+
+static inline uint64_t backoff_next(struct backoff *b)
+{
+    if (b->wait == 0) {
+        b->wait = backoff_policy.min;
+        if (b->rng == 0)
+            b->rng = (uintptr_t)b ^ rdtsc();
+    } else if (b->wait < backoff_policy.max) {
+        b->wait *= 2;
+        if (b->wait > backoff_policy.max)
+            b->wait = backoff_policy.max;
+    }
+    return b->wait;
+}
+
+/* Wait dist threads from the head of the queue, only BACKOFF_PROP uses
+ * dist. */
+static inline void backoff_pause_dist(struct backoff *b, unsigned dist)
+{
+    uint64_t ticks;
+
+    switch (backoff_policy.kind) {
+    case BACKOFF_EXP:
+        backoff_spin(backoff_next(b));
+        break;
+    case BACKOFF_JITTER:
+        ticks = backoff_next(b);
+        b->rng ^= b->rng << 13;
+        b->rng ^= b->rng >> 7;
+        b->rng ^= b->rng << 17;
+        backoff_spin(b->rng % (ticks + 1));
+        break;
+    case BACKOFF_PROP:
+        ticks = (dist ? dist : 1) * backoff_policy.min;
+        backoff_spin(ticks < backoff_policy.max ? ticks : backoff_policy.max);
+        break;
+    default:
+        asm volatile("pause\n": : :"memory");
+        break;
+    }
+}
+
+static inline void backoff_pause(struct backoff *b)
+{
+    backoff_pause_dist(b, 1);
+}
+
+#endif /* _BACKOFF_H */
@@ -0,0 +1,128 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+/* Interface between the spinbench driver (spinbench.c) and the per lock
+ * benchmark objects. Each lock implementation is compiled from
+ * test-spinlock.c into its own object file because the spinlock-*.h headers
+ * all define the same global names. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of total lock/unlock pair.
+ * Note we need to ensure the total pair of lock and unlock opeartion are the
+ * same no matter how many threads are used. */
+#define N_PAIR 16000000
+
+#define CACHE_LINE 64
+
+struct hist;
+struct perf_thread;
+
+/* Workload run for each lock acquisition. */
+struct bench_work {
+    int cs_lines;     /* Cache lines touched inside the critical section. */
+    int cs_shared;    /* Touch data shared by all threads, else thread local. */
+    int cs_write;     /* Increment the data, else only read it. */
+    uint64_t think;   /* Busy work between release and next acquire, TSC ticks. */
+    int think_random; /* Think time uniform in [0, 2 * think]. */
+    int read_pct;     /* Percentage of operations taking the lock for read. */
+    /* Percentage of exclusive operations giving up after timeout ns. Only
+     * used by time bounded runs. */
+    int timeout_pct;
+    uint64_t timeout;
+};
+
+/* Lock ownership history for time bounded runs. Shared by all threads but
+ * only written while holding the lock. */
+struct bench_fair {
+    int owner;       /* Thread which acquired the lock last. */
+    long streak;     /* Consecutive acquisitions by owner. */
+    long max_streak;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct bench_thread {
+    int id;
+    int cpu;  /* CPU the thread is bound to, -1 if not bound. */
+    long ops; /* Number of lock/unlock pairs this thread should do. */
+    const struct bench_work *work;
+    /* cs_lines cache lines touched in the critical section, either private
+     * to this thread or shared depending on work->cs_shared. */
+    int8_t *data;
+    /* Per thread TSC histograms of lock acquire latency and hold time. NULL
+     * unless latency recording is enabled. */
+    struct hist *acquire;
+    struct hist *hold;
+    /* Performance counters of this thread, opened and read by the driver.
+     * NULL unless counters are enabled. */
+    struct perf_thread *perf;
+
+    /* Time bounded run: loop until *stop is set instead of doing ops pairs.
+     * NULL for fixed size runs. */
+    volatile int *stop;
+    struct bench_fair *fair;
+    /* Phased run: the driver sets *phase, only threads with id below
+     * active[*phase] take the lock, the others sleep. Acquisitions are counted
+     * per phase in phase_acquired. NULL unless phases are used. */
+    volatile int *phase;
+    const int *active;
+    long *phase_acquired;
+    /* Results of time bounded run, written once when the thread finishes. */
+    long acquired;
+    long timeouts;     /* Timed acquisitions which gave up. */
+    uint64_t max_wait; /* Longest lock acquire in TSC ticks. */
+};
+
+struct bench_lock {
+    const char *name;
+    /* Reset the lock protecting the counter before each run. */
+    void (*init)(void);
+    /* Thread body, the argument is a struct bench_thread. */
+    void *(*thread)(void *);
+    /* Return 0 if the lock can't run on this CPU. NULL means always ok. */
+    int (*supported)(void);
+    /* Largest number of threads the lock supports, 0 means no limit. */
+    int max_threads;
+    /* Supports acquire with timeout, see bench_work.timeout_pct. */
+    int timeout;
+    /* Describe the internal counters of lock l since it was initialized,
+     * e.g. elision commits and aborts. l is a lock of the generic interface
+     * below, or NULL for the lock of the counter benchmark. Locks keeping
+     * global counters ignore it. NULL if the lock has none. */
+    void (*stats)(void *l, char *buf, size_t len);
+
+    /* Generic interface for benchmarks protecting their own data. The
+     * caller provides lock_size bytes, cache line aligned, for each lock and
+     * node_size bytes of queue node for each thread and lock. Entries which
+     * are not locks, like the per CPU counters, leave it NULL. */
+    size_t lock_size;
+    size_t node_size;
+    void (*lock_init)(void *l);
+    void (*node_init)(void *n);
+    void (*acquire)(void *l, void *n);
+    void (*release)(void *l, void *n);
+    /* Shared acquisition, the same as acquire unless the lock is a
+     * reader-writer lock. */
+    void (*acquire_read)(void *l, void *n);
+    void (*release_read)(void *l, void *n);
+    /* Run fn(arg) under the lock and return its result. Delegating locks may
+     * run it on another thread, the others acquire and release around it. */
+    void *(*execute)(void *l, void *n, void *(*fn)(void *), void *arg);
+
+    /* The same lock with its spin loops following the backoff policy
+     * (backoff.h), NULL if not linked in. */
+    const struct bench_lock *backoff;
+};
+
+/* All lock implementations, defined in locks.c. */
+#define BENCH_MAX_LOCKS 64
+extern const struct bench_lock *const bench_locks[];
+extern const int bench_nlocks;
+const struct bench_lock *bench_find_lock(const char *name);
+
+/* Provided by the driver. Every benchmark thread calls bench_thread_start
+ * before and bench_thread_end after its lock/unlock loop. */
+void bench_thread_start(struct bench_thread *t);
+void bench_thread_end(struct bench_thread *t);
+
+#endif /* _BENCH_H */
@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "hist.h"
+#include "tsc.h"
+#include "percpu.h"
+#include "work.h"
+
+/*
+ * Per CPU counters (percpu.h) in the spinbench lock table, to compare not
+ * sharing with every lock guarding a shared counter. Each operation adds one
+ * to a per CPU counter instead of taking a lock, the --cs-* and --read-pct
+ * workload options don't apply, think time does.
+ *
+ * percpu-rseq updates with restartable sequences, percpu-atomic with lock
+ * xadd on the slot of sched_getcpu. lock_stats shows the exact sum of the
+ * counter next to the number of operations, they must match, and the
+ * approximate read, off by less than COUNTER_BATCH per CPU.
+ */
+
+/* Deltas are folded into the total every COUNTER_BATCH increments. */
+#define COUNTER_BATCH 1024
+
+static struct percpu_counter counter;
+static int counter_flags;
+static long counter_ops;
+
+static void counter_init(void) {
+    if (counter.slot)
+        percpu_counter_destroy(&counter);
+    if (percpu_counter_init(&counter, COUNTER_BATCH, counter_flags) != 0) {
+        perror("percpu_counter_init");
+        exit(EXIT_FAILURE);
+    }
+    counter_ops = 0;
+}
+
+static void rseq_init(void) {
+    counter_flags = 0;
+    counter_init();
+}
+
+static void atomic_init(void) {
+    counter_flags = PERCPU_ATOMIC;
+    counter_init();
+}
+
+static void counter_stats(void *l, char *buf, size_t len) {
+    snprintf(buf, len, "mode=%s sum=%ld ops=%ld read=%ld",
+             counter.rseq ? "rseq" : "atomic",
+             (long)percpu_counter_sum(&counter), counter_ops,
+             (long)percpu_counter_read(&counter));
+}
+
+/* Fixed size or time bounded like inc_thread. With --latency the add counts
+ * as acquire time, hold time is zero. */
+static void *counter_thread(void *arg) {
+    struct bench_thread *t = arg;
+    uint64_t t0, t1, wait, max_wait = 0, rng = t->id + 1;
+    long n = 0;
+
+    /* Register rseq before the clock starts. */
+    percpu_thread_init();
+    bench_thread_start(t);
+
+    while (t->stop ? !*t->stop : n < t->ops) {
+        int p = 0;
+
+        if (t->phase) {
+            p = *t->phase;
+            if (t->id >= t->active[p]) {
+                phase_sleep();
+                continue;
+            }
+        }
+        if (t->acquire || t->stop) {
+            t0 = rdtsc();
+            percpu_counter_add(&counter, 1);
+            t1 = rdtscp();
+            wait = t1 - t0;
+            if (wait > max_wait)
+                max_wait = wait;
+            if (t->acquire) {
+                hist_add(t->acquire, wait);
+                hist_add(t->hold, 0);
+            }
+        } else {
+            percpu_counter_add(&counter, 1);
+        }
+        n++;
+        if (t->phase)
+            t->phase_acquired[p]++;
+        think(t, &rng);
+    }
+    t->acquired = n;
+    t->max_wait = max_wait;
+    __sync_fetch_and_add(&counter_ops, n);
+
+    bench_thread_end(t);
+    return NULL;
+}
+
+const struct bench_lock bench_lock_percpu_rseq = {
+    .name = "percpu-rseq",
+    .init = rseq_init,
+    .thread = counter_thread,
+    .stats = counter_stats,
+};
+
+const struct bench_lock bench_lock_percpu_atomic = {
+    .name = "percpu-atomic",
+    .init = atomic_init,
+    .thread = counter_thread,
+    .stats = counter_stats,
+};
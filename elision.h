@@ -0,0 +1,264 @@
+#ifndef _ELISION_H
+#define _ELISION_H
+
+/* Lock elision with RTM for any lock.
+ *
+ * elision_lock runs the critical section as a transaction which only reads
+ * the lock word, so threads not touching the same data run in parallel. When
+ * the lock is held, the transaction aborts explicitly; the thread waits for
+ * the lock to become free before trying again instead of joining a convoy.
+ * Each abort class has its own retry budget: _XABORT_RETRY and conflicts are
+ * transient and retried, a capacity abort will happen again and takes the
+ * lock right away.
+ *
+ * When elision fails the lock is taken for real and elision is skipped for
+ * the next e->penalty acquisitions of this lock. The penalty doubles on every
+ * failure up to ELISION_SKIP_MAX and halves on every commit, so locks whose
+ * critical sections keep aborting fall back to the plain lock.
+ *
+ * RTM is detected with CPUID at startup. Without it elision_lock and
+ * elision_unlock call the plain lock directly and never execute a TSX
+ * instruction, which would raise SIGILL.
+ *
+ * Counters are per thread and summed up by elision_stats_sum. A thread's
+ * counters are added to a total and freed when it exits. */
+
+#include <cpuid.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "rtm.h"
+
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+/* Retries for each abort class before falling back to the lock. */
+#ifndef ELISION_RETRY_BUSY
+#define ELISION_RETRY_BUSY 3     /* Lock was held inside the transaction. */
+#endif
+#ifndef ELISION_RETRY_CONFLICT
+#define ELISION_RETRY_CONFLICT 3 /* Data conflict with another thread. */
+#endif
+#ifndef ELISION_RETRY_RETRY
+#define ELISION_RETRY_RETRY 3    /* Hardware says retry may succeed. */
+#endif
+
+#define ELISION_SKIP_MIN 4
+#define ELISION_SKIP_MAX 1024
+
+#define ELISION_ABORT_BUSY 0xff
+
+/* Lives next to the lock, in its own cache line so updates don't abort
+ * transactions reading the lock word. */
+struct elision {
+    int skip;    /* Acquisitions left without elision. */
+    int penalty; /* Skip length set by the next failure. */
+} __attribute__((aligned(64)));
+
+struct elision_stats {
+    unsigned long commits;
+    unsigned long busy;      /* Aborts because the lock was held. */
+    unsigned long conflict;
+    unsigned long capacity;
+    unsigned long retry;     /* Other aborts with _XABORT_RETRY set. */
+    unsigned long other;     /* Interrupts, system calls, ... */
+    unsigned long fallbacks; /* Lock taken for real. */
+    unsigned long skipped;   /* Fallbacks without trying elision. */
+    struct elision_stats *next;
+} __attribute__((aligned(64)));
+
+static int elision_rtm;
+/* Live threads' counters, and the sum of exited ones. */
+static struct elision_stats *elision_all;
+static struct elision_stats elision_exited;
+static pthread_mutex_t elision_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t elision_once = PTHREAD_ONCE_INIT;
+static pthread_key_t elision_key;
+static __thread struct elision_stats *elision_self;
+
+static void __attribute__((constructor)) elision_detect(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        elision_rtm = (ebx >> 11) & 1;
+}
+
+static inline int elision_available(void)
+{
+    return elision_rtm;
+}
+
+static void elision_stats_add(struct elision_stats *sum,
+        const struct elision_stats *st)
+{
+    sum->commits += st->commits;
+    sum->busy += st->busy;
+    sum->conflict += st->conflict;
+    sum->capacity += st->capacity;
+    sum->retry += st->retry;
+    sum->other += st->other;
+    sum->fallbacks += st->fallbacks;
+    sum->skipped += st->skipped;
+}
+
+static void elision_thread_exit(void *arg)
+{
+    struct elision_stats *st = arg, **p;
+
+    pthread_mutex_lock(&elision_mutex);
+    for (p = &elision_all; *p != st; p = &(*p)->next)
+        ;
+    *p = st->next;
+    elision_stats_add(&elision_exited, st);
+    pthread_mutex_unlock(&elision_mutex);
+    elision_self = NULL;
+    free(st);
+}
+
+static void elision_key_init(void)
+{
+    if (pthread_key_create(&elision_key, elision_thread_exit) != 0)
+        abort();
+}
+
+static struct elision_stats *elision_register(void)
+{
+    struct elision_stats *st;
+
+    if (posix_memalign((void **)&st, 64, sizeof(*st)) != 0)
+        abort();
+    memset(st, 0, sizeof(*st));
+    pthread_once(&elision_once, elision_key_init);
+    pthread_mutex_lock(&elision_mutex);
+    st->next = elision_all;
+    elision_all = st;
+    pthread_mutex_unlock(&elision_mutex);
+    pthread_setspecific(elision_key, st);
+    elision_self = st;
+    return st;
+}
+
+static inline struct elision_stats *elision_thread_stats(void)
+{
+    struct elision_stats *st = elision_self;
+
+    return st ? st : elision_register();
+}
+
+/* Called outside of transactions only. */
+static inline void elision_failed(struct elision *e)
+{
+    int p = e->penalty ? e->penalty * 2 : ELISION_SKIP_MIN;
+
+    if (p > ELISION_SKIP_MAX)
+        p = ELISION_SKIP_MAX;
+    e->penalty = p;
+    e->skip = p;
+}
+
+static inline void elision_lock(struct elision *e, void *l, void *n,
+        int (*is_locked)(void *), void (*lock)(void *, void *))
+{
+    struct elision_stats *st;
+    int busy = ELISION_RETRY_BUSY;
+    int conflict = ELISION_RETRY_CONFLICT;
+    int retry = ELISION_RETRY_RETRY;
+    unsigned status;
+
+    if (!elision_rtm) {
+        lock(l, n);
+        return;
+    }
+    st = elision_thread_stats();
+    if (e->skip > 0) {
+        e->skip--;
+        st->skipped++;
+        st->fallbacks++;
+        lock(l, n);
+        return;
+    }
+
+    while (1) {
+        status = _xbegin();
+        if (status == _XBEGIN_STARTED) {
+            /* Puts the lock into the read set, a thread taking the lock
+             * for real aborts us. */
+            if (!is_locked(l))
+                return;
+            _xabort(ELISION_ABORT_BUSY);
+        }
+        if ((status & _XABORT_EXPLICIT) &&
+            _XABORT_CODE(status) == ELISION_ABORT_BUSY) {
+            st->busy++;
+            if (busy-- == 0)
+                break;
+            while (is_locked(l))
+                cpu_relax();
+        } else if (status & _XABORT_CAPACITY) {
+            st->capacity++;
+            break;
+        } else if (status & _XABORT_CONFLICT) {
+            st->conflict++;
+            if (conflict-- == 0)
+                break;
+        } else if (status & _XABORT_RETRY) {
+            st->retry++;
+            if (retry-- == 0)
+                break;
+        } else {
+            st->other++;
+            break;
+        }
+    }
+
+    elision_failed(e);
+    st->fallbacks++;
+    lock(l, n);
+}
+
+static inline void elision_unlock(struct elision *e, void *l, void *n,
+        void (*unlock)(void *, void *))
+{
+    if (elision_rtm && _xtest()) {
+        _xend();
+        elision_self->commits++;
+        if (e->penalty)
+            e->penalty /= 2;
+        return;
+    }
+    unlock(l, n);
+}
+
+/* Whether the caller runs an elided critical section. */
+static inline int elision_active(void)
+{
+    return elision_rtm && _xtest();
+}
+
+/* Sum of all threads' counters. Exact only while no thread uses elision. */
+static inline void elision_stats_sum(struct elision_stats *sum)
+{
+    memset(sum, 0, sizeof(*sum));
+    pthread_mutex_lock(&elision_mutex);
+    elision_stats_add(sum, &elision_exited);
+    for (struct elision_stats *st = elision_all; st; st = st->next)
+        elision_stats_add(sum, st);
+    pthread_mutex_unlock(&elision_mutex);
+}
+
+static inline void elision_stats_reset(void)
+{
+    pthread_mutex_lock(&elision_mutex);
+    memset(&elision_exited, 0, sizeof(elision_exited));
+    for (struct elision_stats *st = elision_all; st; st = st->next) {
+        struct elision_stats *next = st->next;
+
+        memset(st, 0, sizeof(*st));
+        st->next = next;
+    }
+    pthread_mutex_unlock(&elision_mutex);
+}
+
+#endif /* _ELISION_H */
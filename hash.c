@@ -0,0 +1,597 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+#include <signal.h>
+#include <math.h>
+#include "bench.h"
+#include "pool.h"
+#include "stripe.h"
+#include "lockstat.h"
+#include "work.h"
+
+/*
+ * Concurrent hash map benchmark on lock striping (stripe.h). The map has a
+ * fixed number of chained buckets, bucket b is guarded by stripe b % stripes,
+ * so one stripe means a single global lock and stripes equal to buckets one
+ * lock per bucket. Gets take the stripe shared, which matters for the
+ * reader-writer locks, puts and deletes take it exclusive.
+ *
+ * Keys are drawn uniformly or from a Zipfian distribution over --keys keys.
+ * Bucket indexes come from a hash of the key, so the hot keys of a skewed run
+ * land on random stripes. Every run reports the share of operations which hit
+ * the busiest stripe: once it stops dropping with more stripes, the skew and
+ * not the stripe count bounds the throughput.
+ *
+ * Lock, stripe count and thread count take comma separated lists, one CSV row
+ * is printed for each combination.
+ */
+
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+
+#define MAX_RUNS 64
+
+typedef struct Entry {
+    struct Entry *next;
+    uint64_t key;
+    uint64_t val;
+} Entry;
+
+struct map {
+    Entry **buckets;
+    uint64_t mask; /* Buckets - 1. */
+    struct stripes locks;
+};
+
+static struct map gmap;
+
+/* Every value stored is a function of its key, so gets can tell a torn or
+ * misplaced entry. */
+static inline uint64_t value_of(uint64_t key) {
+    return ~key;
+}
+
+static inline uint64_t map_bucket(const struct map *m, uint64_t key) {
+    return mix64(key) & m->mask;
+}
+
+/* Return 1 and set *val if key is present. */
+static int map_get(struct map *m, uint64_t key, uint64_t *val, void *lnode) {
+    uint64_t b = map_bucket(m, key);
+    int found = 0;
+
+    stripe_acquire_read(&m->locks, b, lnode);
+    for (Entry *e = m->buckets[b]; e != NULL; e = e->next) {
+        if (e->key == key) {
+            *val = e->val;
+            found = 1;
+            break;
+        }
+    }
+    stripe_release_read(&m->locks, b, lnode);
+    return found;
+}
+
+/* Insert n unless its key is present, then only update the value. Return 1
+ * if n was inserted. */
+static int map_put(struct map *m, Entry *n, void *lnode) {
+    uint64_t b = map_bucket(m, n->key);
+    Entry *e;
+
+    stripe_acquire(&m->locks, b, lnode);
+    for (e = m->buckets[b]; e != NULL; e = e->next) {
+        if (e->key == n->key) {
+            e->val = n->val;
+            break;
+        }
+    }
+    if (e == NULL) {
+        n->next = m->buckets[b];
+        m->buckets[b] = n;
+    }
+    stripe_release(&m->locks, b, lnode);
+    return e == NULL;
+}
+
+/* Return the removed entry, NULL if key is absent. */
+static Entry *map_del(struct map *m, uint64_t key, void *lnode) {
+    uint64_t b = map_bucket(m, key);
+    Entry **p, *e;
+
+    stripe_acquire(&m->locks, b, lnode);
+    for (p = &m->buckets[b]; (e = *p) != NULL; p = &e->next) {
+        if (e->key == key) {
+            *p = e->next;
+            break;
+        }
+    }
+    stripe_release(&m->locks, b, lnode);
+    return e;
+}
+
+/*
+ * Zipfian ranks after "Quickly Generating Billion-Record Synthetic Databases"
+ * by Gray et al., as used by YCSB. Rank 0 is the most popular key, rank i is
+ * drawn with probability proportional to 1 / (i + 1)^theta. Setup sums n
+ * terms, drawing is constant time.
+ */
+struct zipf {
+    uint64_t n;
+    double theta, alpha, zetan, eta, half_pow;
+};
+
+static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+
+    for (uint64_t i = 1; i <= n; i++)
+        sum += 1 / pow(i, theta);
+    return sum;
+}
+
+static void zipf_init(struct zipf *z, uint64_t n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = zeta(n, theta);
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / z->zetan);
+    z->half_pow = 1 + pow(0.5, theta);
+}
+
+static inline uint64_t zipf_next(const struct zipf *z, uint64_t *rng) {
+    double u = (xorshift64(rng) >> 11) * (1.0 / (1ULL << 53));
+    double uz = u * z->zetan;
+    uint64_t r;
+
+    if (uz < 1)
+        return 0;
+    if (uz < z->half_pow)
+        return 1;
+    r = z->n * pow(z->eta * u - z->eta + 1, z->alpha);
+    return r < z->n ? r : z->n - 1;
+}
+
+/* Testing code. */
+
+/* The lock objects call these from the counter benchmark thread, which is
+ * not used here. */
+void bench_thread_start(struct bench_thread *t) {}
+void bench_thread_end(struct bench_thread *t) {}
+
+static struct {
+    const struct bench_lock *locks[MAX_RUNS];
+    int nlocks;
+    int stripes[MAX_RUNS];
+    int nstripes;
+    int threads[MAX_RUNS];
+    int nthreads;
+    int buckets;
+    int keys;
+    int zipf;     /* Else uniform keys. */
+    double theta;
+    int get_pct;  /* The rest is split evenly between puts and deletes. */
+    double duration;
+} opt;
+
+static struct zipf zipf;
+
+struct hash_thread {
+    int id;
+    pthread_t thr;
+    void *lnode;
+    struct pool_cache *cache;
+    Entry *spare;    /* Allocated entry not inserted by the last put. */
+    long *stripe_ops; /* Operations per stripe. */
+    long gets, hits, puts, inserts, dels, removes;
+    long bad;        /* Gets returning a value not matching the key. */
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct pool entry_pool;
+static volatile int start_flag, stop_flag;
+static volatile int nready;
+
+static inline uint64_t next_key(uint64_t *rng) {
+    if (opt.zipf)
+        return zipf_next(&zipf, rng);
+    return xorshift64(rng) % opt.keys;
+}
+
+static inline Entry *entry_alloc(struct pool_cache *c) {
+    Entry *e = pool_alloc(&entry_pool, c);
+
+    if (e == NULL) {
+        perror("entry alloc");
+        exit(EXIT_FAILURE);
+    }
+    return e;
+}
+
+static void *hash_thread(void *arg) {
+    struct hash_thread *t = arg;
+    uint64_t rng = mix64(t->id + 1), key, val;
+    int put_pct = (100 - opt.get_pct) / 2;
+    Entry *e;
+
+    t->cache = pool_thread_init(&entry_pool);
+    t->lnode = stripe_node_new(&gmap.locks);
+    if (t->cache == NULL || t->lnode == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    __sync_fetch_and_add(&nready, 1);
+    while (!start_flag)
+        cpu_relax();
+
+    while (!stop_flag) {
+        int op = xorshift64(&rng) % 100;
+
+        key = next_key(&rng);
+        t->stripe_ops[stripe_index(&gmap.locks, map_bucket(&gmap, key))]++;
+        if (op < opt.get_pct) {
+            t->gets++;
+            if (map_get(&gmap, key, &val, t->lnode)) {
+                t->hits++;
+                if (val != value_of(key))
+                    t->bad++;
+            }
+        } else if (op < opt.get_pct + put_pct) {
+            t->puts++;
+            if (t->spare == NULL)
+                t->spare = entry_alloc(t->cache);
+            t->spare->key = key;
+            t->spare->val = value_of(key);
+            if (map_put(&gmap, t->spare, t->lnode)) {
+                t->inserts++;
+                t->spare = NULL;
+            }
+        } else {
+            t->dels++;
+            if ((e = map_del(&gmap, key, t->lnode)) != NULL) {
+                t->removes++;
+                pool_free(t->cache, e);
+            }
+        }
+    }
+
+    pool_flush(t->cache);
+    return NULL;
+}
+
+/* Fill the map with every other key. Return the number of entries. */
+static long map_fill(struct map *m, void *lnode) {
+    struct pool_cache *c = pool_thread_init(&entry_pool);
+    long n = 0;
+
+    if (c == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint64_t key = 0; key < (uint64_t)opt.keys; key += 2) {
+        Entry *e = entry_alloc(c);
+
+        e->key = key;
+        e->val = value_of(key);
+        n += map_put(m, e, lnode);
+    }
+    return n;
+}
+
+/* Count entries, checking every one is in its bucket with its value. Return
+ * -1 on a bad entry. */
+static long map_count(const struct map *m) {
+    long n = 0;
+
+    for (uint64_t b = 0; b <= m->mask; b++) {
+        for (Entry *e = m->buckets[b]; e != NULL; e = e->next) {
+            if (map_bucket(m, e->key) != b || e->val != value_of(e->key))
+                return -1;
+            n++;
+        }
+    }
+    return n;
+}
+
+static int header_done;
+
+/* One run, return non zero if the map came out inconsistent. */
+static int run(const struct bench_lock *lock, int nstripes, int nthr) {
+    struct hash_thread *thr;
+    void *lnode;
+    long filled;
+
+    if (lock->max_threads && nthr > lock->max_threads) {
+        fprintf(stderr, "skip %s: supports at most %d threads\n",
+                lock->name, lock->max_threads);
+        return 0;
+    }
+    gmap.mask = opt.buckets - 1;
+    gmap.buckets = calloc(opt.buckets, sizeof(Entry *));
+    if (gmap.buckets == NULL || stripes_init(&gmap.locks, lock, nstripes) != 0 ||
+        pool_init(&entry_pool, sizeof(Entry)) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    lnode = stripe_node_new(&gmap.locks);
+    filled = map_fill(&gmap, lnode);
+
+    if (posix_memalign((void **)&thr, CACHE_LINE, nthr * sizeof(*thr)) != 0) {
+        perror("posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+    memset(thr, 0, nthr * sizeof(*thr));
+    start_flag = stop_flag = nready = 0;
+
+    for (int i = 0; i < nthr; i++) {
+        struct hash_thread *t = &thr[i];
+
+        t->id = i;
+        t->stripe_ops = calloc(nstripes, sizeof(long));
+        if (t->stripe_ops == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&t->thr, NULL, hash_thread, t) != 0) {
+            perror("thread creating failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct timespec start, end, wait;
+
+    while (nready < nthr)
+        cpu_relax();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    start_flag = 1;
+    wait.tv_sec = (time_t)opt.duration;
+    wait.tv_nsec = (long)((opt.duration - wait.tv_sec) * 1e9);
+    nanosleep(&wait, NULL);
+    stop_flag = 1;
+    for (int i = 0; i < nthr; i++)
+        pthread_join(thr[i].thr, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long gets = 0, hits = 0, puts = 0, inserts = 0, dels = 0, removes = 0;
+    long bad = 0, hot = 0, ops;
+
+    for (int s = 0; s < nstripes; s++) {
+        long n = 0;
+
+        for (int i = 0; i < nthr; i++)
+            n += thr[i].stripe_ops[s];
+        if (n > hot)
+            hot = n;
+    }
+    for (int i = 0; i < nthr; i++) {
+        struct hash_thread *t = &thr[i];
+
+        gets += t->gets;
+        hits += t->hits;
+        puts += t->puts;
+        inserts += t->inserts;
+        dels += t->dels;
+        removes += t->removes;
+        bad += t->bad;
+    }
+
+    double secs = calc_time(&start, &end);
+    long size = map_count(&gmap);
+
+    ops = gets + puts + dels;
+    if (!header_done) {
+        printf("lock,stripes,buckets,threads,keys,dist,theta,get_pct,secs,"
+               "gets,hit_pct,puts,inserts,dels,removes,mops_per_s,ns_per_op,"
+               "hot_stripe_pct\n");
+        header_done = 1;
+    }
+    printf("%s,%d,%d,%d,%d,%s,%.2f,%d,%.3f,%ld,%.1f,%ld,%ld,%ld,%ld,%.3f,%.1f,%.2f\n",
+           lock->name, nstripes, opt.buckets, nthr, opt.keys,
+           opt.zipf ? "zipf" : "uniform", opt.zipf ? opt.theta : 0,
+           opt.get_pct, secs, gets, gets ? 100.0 * hits / gets : 0, puts,
+           inserts, dels, removes, ops / secs / 1e6,
+           ops ? secs * nthr * 1e9 / ops : 0, ops ? 100.0 * hot / ops : 0);
+    fflush(stdout);
+
+    int fail = 0;
+
+    if (bad || size != filled + inserts - removes) {
+        fprintf(stderr, "FAIL: %s with %d stripes: %ld bad gets, map has %ld "
+                "entries, expected %ld\n", lock->name, nstripes, bad, size,
+                filled + inserts - removes);
+        fail = 1;
+    }
+
+    for (int i = 0; i < nthr; i++) {
+        free(thr[i].stripe_ops);
+        free(thr[i].lnode);
+    }
+    free(thr);
+    free(lnode);
+    pool_destroy(&entry_pool);
+    stripes_destroy(&gmap.locks);
+    free(gmap.buckets);
+    return fail;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options]\n"
+           "  -l, --lock=NAME,...     locks to run (default pthread)\n"
+           "  -s, --stripes=N,...     stripe counts, powers of two (default 1,16,256)\n"
+           "  -t, --threads=N,...     thread counts (default 4)\n"
+           "  -b, --buckets=N         buckets, a power of two (default 65536)\n"
+           "  -k, --keys=N            number of distinct keys (default 100000)\n"
+           "  -D, --dist=NAME         key distribution, uniform or zipf (default uniform)\n"
+           "  -z, --theta=T           Zipf skew in (0, 1) (default 0.99)\n"
+           "  -g, --get-pct=P         percentage of gets, the rest are puts and\n"
+           "                          deletes (default 90)\n"
+           "  -d, --duration=SEC      run time in seconds of each run (default 1)\n",
+           prog);
+}
+
+static int parse_int(const char *s, int min, const char *what) {
+    char *end;
+    long v = strtol(s, &end, 10);
+
+    if (*s == '\0' || *end != '\0' || v < min) {
+        fprintf(stderr, "invalid %s: %s\n", what, s);
+        exit(EXIT_FAILURE);
+    }
+    return v;
+}
+
+static int parse_pow2(const char *s, const char *what) {
+    int v = parse_int(s, 1, what);
+
+    if (v & (v - 1)) {
+        fprintf(stderr, "%s must be a power of two: %s\n", what, s);
+        exit(EXIT_FAILURE);
+    }
+    return v;
+}
+
+/* Split a comma separated list, return the number of items. */
+static int split(char *arg, char **items, const char *what) {
+    int n = 0;
+
+    for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        if (n == MAX_RUNS) {
+            fprintf(stderr, "too many %s\n", what);
+            exit(EXIT_FAILURE);
+        }
+        items[n++] = tok;
+    }
+    if (n == 0) {
+        fprintf(stderr, "empty %s list\n", what);
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_opts[] = {
+        { "lock", required_argument, NULL, 'l' },
+        { "stripes", required_argument, NULL, 's' },
+        { "threads", required_argument, NULL, 't' },
+        { "buckets", required_argument, NULL, 'b' },
+        { "keys", required_argument, NULL, 'k' },
+        { "dist", required_argument, NULL, 'D' },
+        { "theta", required_argument, NULL, 'z' },
+        { "get-pct", required_argument, NULL, 'g' },
+        { "duration", required_argument, NULL, 'd' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    char lock_arg[] = "pthread", stripes_arg[] = "1,16,256", threads_arg[] = "4";
+    char *locks = lock_arg, *stripes = stripes_arg, *threads = threads_arg;
+    char *items[MAX_RUNS];
+    int c, fail = 0;
+
+    opt.buckets = 65536;
+    opt.keys = 100000;
+    opt.theta = 0.99;
+    opt.get_pct = 90;
+    opt.duration = 1;
+
+    /* With LOCKSTAT, SIGUSR1 prints the lock report. */
+    lockstat_report_on_signal(SIGUSR1);
+
+    while ((c = getopt_long(argc, argv, "l:s:t:b:k:D:z:g:d:h", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'l':
+            locks = optarg;
+            break;
+        case 's':
+            stripes = optarg;
+            break;
+        case 't':
+            threads = optarg;
+            break;
+        case 'b':
+            opt.buckets = parse_pow2(optarg, "buckets");
+            break;
+        case 'k':
+            opt.keys = parse_int(optarg, 2, "keys");
+            break;
+        case 'D':
+            if (strcmp(optarg, "uniform") == 0) {
+                opt.zipf = 0;
+            } else if (strcmp(optarg, "zipf") == 0) {
+                opt.zipf = 1;
+            } else {
+                fprintf(stderr, "unknown distribution: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            opt.theta = atof(optarg);
+            if (opt.theta <= 0 || opt.theta >= 1) {
+                fprintf(stderr, "theta must be in (0, 1): %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'g':
+            opt.get_pct = parse_int(optarg, 0, "get-pct");
+            if (opt.get_pct > 100) {
+                fprintf(stderr, "get-pct must be at most 100\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd':
+            opt.duration = atof(optarg);
+            if (opt.duration <= 0) {
+                fprintf(stderr, "invalid duration: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    opt.nlocks = split(locks, items, "locks");
+    for (int i = 0; i < opt.nlocks; i++) {
+        opt.locks[i] = bench_find_lock(items[i]);
+        if (!opt.locks[i]) {
+            fprintf(stderr, "unknown lock: %s\n", items[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    opt.nstripes = split(stripes, items, "stripes");
+    for (int i = 0; i < opt.nstripes; i++) {
+        opt.stripes[i] = parse_pow2(items[i], "stripes");
+        if (opt.stripes[i] > opt.buckets) {
+            fprintf(stderr, "more stripes than buckets: %d\n", opt.stripes[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    opt.nthreads = split(threads, items, "threads");
+    for (int i = 0; i < opt.nthreads; i++)
+        opt.threads[i] = parse_int(items[i], 1, "threads");
+    if (opt.zipf)
+        zipf_init(&zipf, opt.keys, opt.theta);
+
+    for (int i = 0; i < opt.nlocks; i++) {
+        const struct bench_lock *lock = opt.locks[i];
+
+        if (!lock->acquire) {
+            fprintf(stderr, "skip %s: not a lock\n", lock->name);
+            continue;
+        }
+        if (lock->supported && !lock->supported()) {
+            fprintf(stderr, "skip %s: not supported on this CPU\n", lock->name);
+            continue;
+        }
+        for (int t = 0; t < opt.nthreads; t++) {
+            for (int s = 0; s < opt.nstripes; s++)
+                fail |= run(lock, opt.stripes[s], opt.threads[t]);
+        }
+    }
+    return fail;
+}
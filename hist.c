@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hist.h"
+#include "bench.h"
+
+struct hist *hist_new(void)
+{
+    struct hist *h;
+
+    /* Cache line aligned so two threads' histograms never share a line. */
+    if (posix_memalign((void **)&h, CACHE_LINE, sizeof(*h)) != 0)
+        return NULL;
+    memset(h, 0, sizeof(*h));
+    return h;
+}
+
+void hist_free(struct hist *h)
+{
+    free(h);
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+    for (int i = 0; i < HIST_NBUCKET; i++)
+        dst->bucket[i] += src->bucket[i];
+    dst->count += src->count;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/* Lowest value that maps to bucket index i. */
+static uint64_t bucket_low(int i)
+{
+    int shift = i / HIST_SUB - 1;
+
+    if (shift < 0)
+        return i;
+    return (uint64_t)(HIST_SUB + i % HIST_SUB) << shift;
+}
+
+static uint64_t bucket_width(int i)
+{
+    int shift = i / HIST_SUB - 1;
+
+    return shift < 0 ? 1 : (uint64_t)1 << shift;
+}
+
+uint64_t hist_quantile(const struct hist *h, double q)
+{
+    uint64_t rank, seen = 0, v;
+
+    if (h->count == 0)
+        return 0;
+    rank = (uint64_t)(q * h->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    if (rank > h->count)
+        rank = h->count;
+
+    for (int i = 0; i < HIST_NBUCKET; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) {
+            v = bucket_low(i) + bucket_width(i) / 2;
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,50 @@
+#ifndef _HIST_H
+#define _HIST_H
+
+#include <stdint.h>
+
+/* Log-linear latency histogram in the style of HdrHistogram.
+ *
+ * Values below HIST_SUB are counted exactly. Above that, every power of two
+ * is split into HIST_SUB linear sub buckets, so the relative error of a
+ * recorded value is below 1/HIST_SUB (about 3%). Each benchmark thread owns
+ * its own histograms and they are merged after the run, recording never
+ * writes shared memory. */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_NBUCKET ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t bucket[HIST_NBUCKET];
+};
+
+static inline int hist_index(uint64_t v)
+{
+    int msb, shift;
+
+    if (v < HIST_SUB)
+        return v;
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+static inline void hist_add(struct hist *h, uint64_t v)
+{
+    h->bucket[hist_index(v)]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+struct hist *hist_new(void);
+void hist_free(struct hist *h);
+void hist_merge(struct hist *dst, const struct hist *src);
+/* Value at quantile q (0 < q <= 1). Returns the middle of the bucket, or the
+ * recorded max if that is smaller. */
+uint64_t hist_quantile(const struct hist *h, double q);
+
+#endif /* _HIST_H */
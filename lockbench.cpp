@@ -0,0 +1,181 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "spinlock.hpp"
+
+/* The C xchg lock as baseline for the C++ version. */
+extern "C" {
+#include "spinlock-xchg.h"
+}
+#undef barrier
+#undef cpu_relax
+
+/* Benchmark for spinlock.hpp. Every lock is instantiated with every backoff
+ * and padding policy and runs the counter benchmark of spinbench: threads
+ * increment a shared counter under std::lock_guard, N_PAIR increments in
+ * total no matter how many threads are used. Prints one CSV row per lock,
+ * policy combination and thread count. */
+
+#define N_PAIR 16000000
+
+namespace {
+
+struct c_xchg_lock {
+    static constexpr const char *name = "c-xchg";
+    using backoff_policy = spin::relax;
+    using padding_policy = spin::no_padding;
+    spinlock l = SPINLOCK_INITIALIZER;
+
+    void lock() noexcept { spin_lock(&l); }
+    void unlock() noexcept { spin_unlock(&l); }
+    bool try_lock() noexcept { return !spin_trylock(&l); }
+};
+
+struct config {
+    std::vector<int> threads;
+    long ops;
+    bool calibrated;
+};
+
+template <class Lock>
+struct alignas(spin::cache_line) shared_state {
+    Lock lock;
+    alignas(spin::cache_line) long counter = 0;
+};
+
+template <class Lock>
+void run(const config &cfg)
+{
+    /* std::scoped_lock on two locks needs the Lockable try_lock. */
+    {
+        Lock a, b;
+        std::scoped_lock both(a, b);
+    }
+
+    for (int n : cfg.threads) {
+        auto *st = new shared_state<Lock>;
+        long per_thread = cfg.ops / n;
+        std::vector<std::thread> thr;
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; i++) {
+            thr.emplace_back([st, per_thread] {
+                for (long j = 0; j < per_thread; j++) {
+                    std::lock_guard<Lock> g(st->lock);
+                    st->counter++;
+                }
+            });
+        }
+        for (auto &t : thr)
+            t.join();
+        auto end = std::chrono::steady_clock::now();
+
+        double sec = std::chrono::duration<double>(end - start).count();
+        long ops = per_thread * n;
+
+        if (st->counter != ops) {
+            std::fprintf(stderr, "%s: counter %ld, expected %ld\n",
+                         Lock::name, st->counter, ops);
+            std::exit(EXIT_FAILURE);
+        }
+        std::printf("%s,%s,%s,%d,%ld,%.3f,%.3f\n", Lock::name,
+                    Lock::backoff_policy::name, Lock::padding_policy::name,
+                    n, ops, sec * 1e9 / ops, ops / sec / 1e6);
+        std::fflush(stdout);
+        delete st;
+    }
+}
+
+/* Every backoff and padding policy for one lock template. The calibrated
+ * policy only runs when configured with -b. */
+template <template <class, class> class Lock>
+void run_policies(const config &cfg)
+{
+    run<Lock<spin::relax, spin::no_padding>>(cfg);
+    run<Lock<spin::relax, spin::cache_padded>>(cfg);
+    run<Lock<spin::exp_backoff<>, spin::no_padding>>(cfg);
+    run<Lock<spin::exp_backoff<>, spin::cache_padded>>(cfg);
+    if (cfg.calibrated) {
+        run<Lock<spin::calibrated, spin::no_padding>>(cfg);
+        run<Lock<spin::calibrated, spin::cache_padded>>(cfg);
+    }
+}
+
+void parse_threads(char *arg, std::vector<int> &threads)
+{
+    char *save, *s;
+
+    threads.clear();
+    for (s = strtok_r(arg, ",", &save); s; s = strtok_r(nullptr, ",", &save)) {
+        int n = std::atoi(s);
+        if (n <= 0) {
+            std::fprintf(stderr, "invalid thread count: %s\n", s);
+            std::exit(EXIT_FAILURE);
+        }
+        threads.push_back(n);
+    }
+}
+
+} /* namespace */
+
+int main(int argc, char *argv[])
+{
+    config cfg;
+    int c, kind = BACKOFF_NONE;
+    long min_ns = 50, max_ns = 5000;
+
+    cfg.threads = { 1 };
+    cfg.ops = N_PAIR;
+    cfg.calibrated = false;
+    while ((c = getopt(argc, argv, "t:n:b:m:M:h")) != -1) {
+        switch (c) {
+        case 't':
+            parse_threads(optarg, cfg.threads);
+            break;
+        case 'n':
+            cfg.ops = std::atol(optarg);
+            if (cfg.ops <= 0) {
+                std::fprintf(stderr, "invalid ops: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            kind = backoff_parse(optarg);
+            if (kind < 0) {
+                std::fprintf(stderr, "invalid backoff: %s\n", optarg);
+                return 1;
+            }
+            cfg.calibrated = true;
+            break;
+        case 'm':
+            min_ns = std::atol(optarg);
+            break;
+        case 'M':
+            max_ns = std::atol(optarg);
+            break;
+        default:
+            std::printf("Usage: %s [-t threads,...] [-n total ops]\n"
+                        "       [-b none|exp|jitter|prop] [-m min ns] [-M max ns]\n",
+                        argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (cfg.calibrated)
+        backoff_configure((backoff_kind)kind, min_ns, max_ns, tsc_calibrate());
+
+    std::printf("lock,backoff,padding,threads,ops,ns_per_op,mops_per_s\n");
+    run<c_xchg_lock>(cfg);
+    run_policies<spin::xchg_lock>(cfg);
+    run_policies<spin::cmpxchg_lock>(cfg);
+    run_policies<spin::ticket_lock>(cfg);
+    run_policies<spin::k42_lock>(cfg);
+    run_policies<spin::mcs_lock>(cfg);
+    run_policies<spin::hle_lock>(cfg);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include <string.h>
+#include "bench.h"
+
+/* Registry of the lock implementations, each compiled from test-spinlock.c
+ * into its own object. Shared by the benchmark drivers. */
+
+extern const struct bench_lock bench_lock_xchg, bench_lock_xchg_backoff,
+       bench_lock_cmpxchg, bench_lock_ticket, bench_lock_k42, bench_lock_mcs,
+       bench_lock_pthread, bench_lock_hle, bench_lock_rtm, bench_lock_cohort,
+       bench_lock_clh, bench_lock_clh_padded, bench_lock_futex,
+       bench_lock_rw_counter, bench_lock_rw_ticket, bench_lock_rw_phasefair,
+       bench_lock_rw_percpu, bench_lock_anderson, bench_lock_ticket_partitioned,
+       bench_lock_ticket_backoff, bench_lock_rtm_ticket, bench_lock_rtm_mcs,
+       bench_lock_rtm_futex, bench_lock_reactive,
+       bench_lock_qspinlock, bench_lock_clh_timeout,
+       bench_lock_fc, bench_lock_percpu_rseq, bench_lock_percpu_atomic;
+
+const struct bench_lock *const bench_locks[] = {
+    &bench_lock_xchg,
+    &bench_lock_xchg_backoff,
+    &bench_lock_cmpxchg,
+    &bench_lock_ticket,
+    &bench_lock_k42,
+    &bench_lock_mcs,
+    &bench_lock_pthread,
+    &bench_lock_hle,
+    &bench_lock_rtm,
+    &bench_lock_cohort,
+    &bench_lock_clh,
+    &bench_lock_clh_padded,
+    &bench_lock_futex,
+    &bench_lock_rw_counter,
+    &bench_lock_rw_ticket,
+    &bench_lock_rw_phasefair,
+    &bench_lock_rw_percpu,
+    &bench_lock_anderson,
+    &bench_lock_ticket_partitioned,
+    &bench_lock_ticket_backoff,
+    &bench_lock_rtm_ticket,
+    &bench_lock_rtm_mcs,
+    &bench_lock_rtm_futex,
+    &bench_lock_reactive,
+    &bench_lock_qspinlock,
+    &bench_lock_clh_timeout,
+    &bench_lock_fc,
+    &bench_lock_percpu_rseq,
+    &bench_lock_percpu_atomic,
+};
+const int bench_nlocks = sizeof(bench_locks) / sizeof(bench_locks[0]);
+
+const struct bench_lock *bench_find_lock(const char *name) {
+    for (int i = 0; i < bench_nlocks; i++) {
+        if (strcmp(bench_locks[i]->name, name) == 0)
+            return bench_locks[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,424 @@
+#ifndef _LOCKSTAT_H
+#define _LOCKSTAT_H
+
+/* Lock contention profiler after Linux lockstat, compiled in with -DLOCKSTAT.
+ *
+ * Wrap any lock of the spinlock-*.h headers:
+ *
+ *     LOCKSTAT_LOCK(&l, spin_lock(&l));
+ *     ...
+ *     LOCKSTAT_UNLOCK(&l, spin_unlock(&l));
+ *
+ * or call lockstat_start before and lockstat_acquired after acquiring, and
+ * lockstat_released before releasing. lockstat_name gives a lock a name for
+ * the report. Without LOCKSTAT all of these compile to the plain lock calls.
+ *
+ * Per lock instance it records acquisitions, contended acquisitions (waiting
+ * at least LOCKSTAT_CONTENDED TSC ticks), total and max wait and hold time,
+ * and how often the lock moved to another CPU or NUMA node. Counters live in
+ * per thread tables keyed by lock address, so recording writes no shared
+ * memory except the previous holder's CPU, which is written while holding
+ * the lock. When a thread exits its table is folded into a global one and
+ * freed. Tables are merged when the report is printed, to stderr at exit or
+ * whenever a signal set up with lockstat_report_on_signal arrives. The
+ * report is sorted by total wait time. Reports while threads run read their
+ * counters without synchronization and may be slightly off.
+ *
+ * Every object including this header shares the weak globals below, so one
+ * report covers the whole program. */
+
+#include <stdint.h>
+#include "tsc.h"
+
+#ifdef LOCKSTAT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+
+#ifndef LOCKSTAT_CONTENDED
+#define LOCKSTAT_CONTENDED 1000
+#endif
+/* Distinct locks per thread, further locks are merged into one record. */
+#ifndef LOCKSTAT_LOCKS
+#define LOCKSTAT_LOCKS 4096
+#endif
+/* Locks a thread can hold at the same time. */
+#define LOCKSTAT_DEPTH 16
+#define LOCKSTAT_OWNERS 4096
+#define LOCKSTAT_NAMES 1024
+
+struct lockstat_rec {
+    const void *volatile lock; /* NULL for an unused record. */
+    unsigned long acquired;
+    unsigned long contended;
+    uint64_t wait, wait_max; /* TSC ticks. */
+    uint64_t hold, hold_max;
+    unsigned long cpu_handoffs;
+    unsigned long node_handoffs;
+};
+
+struct lockstat_thread {
+    struct lockstat_thread *next;
+    int depth;
+    struct {
+        const void *lock;
+        uint64_t since;
+        struct lockstat_rec *rec;
+    } held[LOCKSTAT_DEPTH];
+    struct lockstat_rec other; /* Locks which didn't fit the table. */
+    struct lockstat_rec rec[LOCKSTAT_LOCKS];
+};
+
+/* Last holder of the locks hashing to each entry, written under the lock. */
+struct lockstat_owner {
+    const void *lock;
+    int cpu;
+    int node;
+} __attribute__((aligned(64)));
+
+struct lockstat_name {
+    const void *lock;
+    const char *name;
+};
+
+/* Live threads, and the records of exited ones. */
+struct lockstat_thread *lockstat_threads __attribute__((weak));
+struct lockstat_rec lockstat_exited[LOCKSTAT_LOCKS] __attribute__((weak));
+struct lockstat_rec lockstat_exited_other __attribute__((weak));
+pthread_mutex_t lockstat_mutex __attribute__((weak)) = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t lockstat_once __attribute__((weak)) = PTHREAD_ONCE_INIT;
+pthread_key_t lockstat_key __attribute__((weak));
+__thread struct lockstat_thread *lockstat_self __attribute__((weak));
+struct lockstat_owner lockstat_owners[LOCKSTAT_OWNERS] __attribute__((weak));
+struct lockstat_name lockstat_names[LOCKSTAT_NAMES] __attribute__((weak));
+volatile int lockstat_nnames __attribute__((weak));
+
+static inline unsigned lockstat_hash(const void *l)
+{
+    uint64_t h = (uintptr_t)l;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Name l in the report, name must stay valid. Extra names are dropped. */
+static inline void lockstat_name(const void *l, const char *name)
+{
+    int i = __sync_fetch_and_add(&lockstat_nnames, 1);
+
+    if (i < LOCKSTAT_NAMES) {
+        lockstat_names[i].name = name;
+        lockstat_names[i].lock = l;
+    }
+}
+
+static const char *lockstat_name_of(const void *l)
+{
+    int n = lockstat_nnames < LOCKSTAT_NAMES ? lockstat_nnames : LOCKSTAT_NAMES;
+
+    /* The last name given to an address wins, locks may be reused. */
+    for (int i = n - 1; i >= 0; i--) {
+        if (lockstat_names[i].lock == l)
+            return lockstat_names[i].name;
+    }
+    return NULL;
+}
+
+static void lockstat_merge(struct lockstat_rec *to, const struct lockstat_rec *r)
+{
+    to->acquired += r->acquired;
+    to->contended += r->contended;
+    to->wait += r->wait;
+    to->hold += r->hold;
+    to->cpu_handoffs += r->cpu_handoffs;
+    to->node_handoffs += r->node_handoffs;
+    if (r->wait_max > to->wait_max)
+        to->wait_max = r->wait_max;
+    if (r->hold_max > to->hold_max)
+        to->hold_max = r->hold_max;
+}
+
+/* Add r to the record with the same lock in table t of n entries, n a power
+ * of two. Return 0 if t is full. */
+static int lockstat_table_add(struct lockstat_rec *t, size_t n,
+        const struct lockstat_rec *r)
+{
+    size_t h = lockstat_hash(r->lock);
+
+    for (size_t i = 0; i < n; i++) {
+        struct lockstat_rec *e = &t[(h + i) & (n - 1)];
+
+        if (!e->lock)
+            e->lock = r->lock;
+        if (e->lock == r->lock) {
+            lockstat_merge(e, r);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int lockstat_cmp(const void *a, const void *b)
+{
+    const struct lockstat_rec *x = a, *y = b;
+
+    return x->wait < y->wait ? 1 : x->wait > y->wait ? -1 : 0;
+}
+
+/* Print the merged records of all threads to f. */
+static void lockstat_report(FILE *f)
+{
+    struct lockstat_rec *all, other;
+    size_t n = 0, cap = LOCKSTAT_LOCKS;
+    double tsc_per_ns = tsc_calibrate();
+
+    pthread_mutex_lock(&lockstat_mutex);
+    for (struct lockstat_thread *t = lockstat_threads; t; t = t->next)
+        cap += LOCKSTAT_LOCKS;
+    /* Power of two with room to spare for hashing, plus other. */
+    while (cap & (cap - 1))
+        cap &= cap - 1;
+    cap *= 2;
+    all = calloc(cap + 1, sizeof(*all));
+    if (!all) {
+        pthread_mutex_unlock(&lockstat_mutex);
+        fprintf(f, "lockstat: no memory for the report\n");
+        return;
+    }
+    other = lockstat_exited_other;
+    for (int i = 0; i < LOCKSTAT_LOCKS; i++) {
+        if (lockstat_exited[i].lock)
+            lockstat_table_add(all, cap, &lockstat_exited[i]);
+    }
+    for (struct lockstat_thread *t = lockstat_threads; t; t = t->next) {
+        lockstat_merge(&other, &t->other);
+        for (int i = 0; i < LOCKSTAT_LOCKS; i++) {
+            if (t->rec[i].lock)
+                lockstat_table_add(all, cap, &t->rec[i]);
+        }
+    }
+    pthread_mutex_unlock(&lockstat_mutex);
+    for (size_t i = 0; i < cap; i++) {
+        if (all[i].lock)
+            all[n++] = all[i];
+    }
+    qsort(all, n, sizeof(*all), lockstat_cmp);
+    if (other.acquired)
+        all[n++] = other;
+
+    fprintf(f, "lockstat: %-20s %12s %12s %6s %12s %10s %10s %12s %10s %10s %10s %10s\n",
+            "lock", "acquired", "contended", "cont%", "wait_ms", "wait_avg",
+            "wait_max", "hold_ms", "hold_avg", "hold_max", "cpu_moves",
+            "node_moves");
+    for (size_t i = 0; i < n; i++) {
+        const struct lockstat_rec *r = &all[i];
+        const char *name = r->lock ? lockstat_name_of(r->lock) : "(other)";
+        char addr[24];
+        double acq = r->acquired ? r->acquired : 1;
+
+        if (!name) {
+            snprintf(addr, sizeof(addr), "%p", r->lock);
+            name = addr;
+        }
+        fprintf(f, "lockstat: %-20s %12lu %12lu %6.2f %12.3f %10.1f %10.1f "
+                "%12.3f %10.1f %10.1f %10lu %10lu\n",
+                name, r->acquired, r->contended, 100 * r->contended / acq,
+                r->wait / tsc_per_ns / 1e6, r->wait / tsc_per_ns / acq,
+                r->wait_max / tsc_per_ns, r->hold / tsc_per_ns / 1e6,
+                r->hold / tsc_per_ns / acq, r->hold_max / tsc_per_ns,
+                r->cpu_handoffs, r->node_handoffs);
+    }
+    fflush(f);
+    free(all);
+}
+
+static void lockstat_report_exit(void)
+{
+    lockstat_report(stderr);
+}
+
+static void *lockstat_signal_thread(void *arg)
+{
+    sigset_t *set = arg;
+    int sig;
+
+    while (sigwait(set, &sig) == 0)
+        lockstat_report(stderr);
+    return NULL;
+}
+
+/* Print the report whenever sig arrives. Blocks sig in the calling thread,
+ * call it before creating other threads so they inherit the mask. */
+static inline int lockstat_report_on_signal(int sig)
+{
+    static sigset_t set;
+    pthread_t thr;
+
+    sigemptyset(&set);
+    sigaddset(&set, sig);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+        return -1;
+    if (pthread_create(&thr, NULL, lockstat_signal_thread, &set) != 0)
+        return -1;
+    pthread_detach(thr);
+    return 0;
+}
+
+/* Fold the table of an exiting thread into lockstat_exited and free it. */
+static void lockstat_thread_exit(void *arg)
+{
+    struct lockstat_thread *t = arg, **p;
+
+    pthread_mutex_lock(&lockstat_mutex);
+    for (p = &lockstat_threads; *p != t; p = &(*p)->next)
+        ;
+    *p = t->next;
+    lockstat_merge(&lockstat_exited_other, &t->other);
+    for (int i = 0; i < LOCKSTAT_LOCKS; i++) {
+        const struct lockstat_rec *r = &t->rec[i];
+
+        if (r->lock && !lockstat_table_add(lockstat_exited, LOCKSTAT_LOCKS, r))
+            lockstat_merge(&lockstat_exited_other, r);
+    }
+    pthread_mutex_unlock(&lockstat_mutex);
+    lockstat_self = NULL;
+    free(t);
+}
+
+static void lockstat_key_init(void)
+{
+    if (pthread_key_create(&lockstat_key, lockstat_thread_exit) != 0)
+        abort();
+    atexit(lockstat_report_exit);
+}
+
+static struct lockstat_thread *lockstat_thread_init(void)
+{
+    struct lockstat_thread *t = calloc(1, sizeof(*t));
+
+    if (!t)
+        abort();
+    pthread_once(&lockstat_once, lockstat_key_init);
+    pthread_mutex_lock(&lockstat_mutex);
+    t->next = lockstat_threads;
+    lockstat_threads = t;
+    pthread_mutex_unlock(&lockstat_mutex);
+    pthread_setspecific(lockstat_key, t);
+    lockstat_self = t;
+    return t;
+}
+
+static inline struct lockstat_rec *lockstat_rec_of(struct lockstat_thread *t,
+        const void *l)
+{
+    unsigned h = lockstat_hash(l);
+
+    for (int i = 0; i < 8; i++) {
+        struct lockstat_rec *r = &t->rec[(h + i) % LOCKSTAT_LOCKS];
+
+        if (r->lock == l)
+            return r;
+        if (!r->lock) {
+            /* Publish the address last for a concurrent report. */
+            __sync_synchronize();
+            r->lock = l;
+            return r;
+        }
+    }
+    return &t->other;
+}
+
+static inline uint64_t lockstat_start(void)
+{
+    return rdtsc();
+}
+
+/* Call right after l was acquired, start from lockstat_start. */
+static inline void lockstat_acquired(const void *l, uint64_t start)
+{
+    struct lockstat_thread *t = lockstat_self;
+    struct lockstat_owner *o = &lockstat_owners[lockstat_hash(l) % LOCKSTAT_OWNERS];
+    struct lockstat_rec *r;
+    uint64_t now = rdtscp(), wait = now - start;
+    unsigned cpu = 0, node = 0;
+
+    if (!t)
+        t = lockstat_thread_init();
+    r = lockstat_rec_of(t, l);
+    r->acquired++;
+    r->wait += wait;
+    if (wait > r->wait_max)
+        r->wait_max = wait;
+    if (wait >= LOCKSTAT_CONTENDED)
+        r->contended++;
+
+    getcpu(&cpu, &node);
+    if (o->lock == l) {
+        r->cpu_handoffs += o->cpu != (int)cpu;
+        r->node_handoffs += o->node != (int)node;
+    }
+    o->lock = l;
+    o->cpu = cpu;
+    o->node = node;
+
+    if (t->depth < LOCKSTAT_DEPTH) {
+        t->held[t->depth].lock = l;
+        t->held[t->depth].since = rdtsc();
+        t->held[t->depth].rec = r;
+    }
+    t->depth++;
+}
+
+/* Call right before l is released. */
+static inline void lockstat_released(const void *l)
+{
+    struct lockstat_thread *t = lockstat_self;
+    int d;
+
+    if (!t || t->depth == 0)
+        return;
+    d = t->depth < LOCKSTAT_DEPTH ? t->depth : LOCKSTAT_DEPTH;
+    /* Locks are usually released in reverse order. */
+    while (--d >= 0 && t->held[d].lock != l)
+        ;
+    if (d >= 0) {
+        uint64_t hold = rdtsc() - t->held[d].since;
+        struct lockstat_rec *r = t->held[d].rec;
+
+        r->hold += hold;
+        if (hold > r->hold_max)
+            r->hold_max = hold;
+        for (; d < t->depth - 1 && d < LOCKSTAT_DEPTH - 1; d++)
+            t->held[d] = t->held[d + 1];
+    }
+    t->depth--;
+}
+
+#else /* LOCKSTAT */
+
+static inline uint64_t lockstat_start(void) { return 0; }
+static inline void lockstat_acquired(const void *l, uint64_t start) {}
+static inline void lockstat_released(const void *l) {}
+static inline void lockstat_name(const void *l, const char *name) {}
+static inline int lockstat_report_on_signal(int sig) { return 0; }
+
+#endif /* LOCKSTAT */
+
+#define LOCKSTAT_LOCK(l, acquire) do {          \
+        uint64_t _lockstat_t0 = lockstat_start(); \
+        acquire;                                \
+        lockstat_acquired((l), _lockstat_t0);   \
+    } while (0)
+
+#define LOCKSTAT_UNLOCK(l, release) do {        \
+        lockstat_released(l);                   \
+        release;                                \
+    } while (0)
+
+#endif /* _LOCKSTAT_H */
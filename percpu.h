@@ -0,0 +1,359 @@
+#ifndef _PERCPU_H
+#define _PERCPU_H
+
+/* Per CPU counter and stack on Linux restartable sequences (rseq).
+ *
+ * Every CPU has its own slot on its own cache line. An update runs as a
+ * restartable sequence: it checks it's still on the CPU it read, computes the
+ * new value and commits it with a single store. If the thread is preempted,
+ * migrated or gets a signal before the commit, the kernel moves it to the
+ * abort handler and the update starts over. Slots are only ever written by
+ * the CPU they belong to, so updates need neither a lock prefix nor a shared
+ * cache line.
+ *
+ * The counter keeps a folded total next to the per CPU deltas, after the
+ * Linux percpu_counter. A delta reaching the batch in either direction is
+ * moved to the total with one atomic add. percpu_counter_read returns the
+ * total, which is off by less than batch per CPU. percpu_counter_sum adds all
+ * deltas and is exact once the updates it must see have returned.
+ *
+ * The stack is a per CPU list of objects whose first word is used as link,
+ * like a freelist. Pop only sees the current CPU's list, so it can return
+ * NULL while other CPUs have objects.
+ *
+ * glibc 2.35 and later register rseq for every thread. Otherwise each thread
+ * registers its own area on first use. Without rseq, or with PERCPU_ATOMIC,
+ * counter slots are updated with lock xadd and stacks have a test-and-set lock
+ * per CPU, both indexed by sched_getcpu. A structure uses one mode for all
+ * threads: rseq and atomic updates of the same slot don't mix. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <linux/rseq.h>
+
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+#define PERCPU_RSEQ_SIG 0x53053053
+
+/* Flag of percpu_counter_init and percpu_stack_init: use atomics even if
+ * rseq is available. */
+#define PERCPU_ATOMIC 1
+
+/* Defined by glibc 2.35 and later, NULL before. */
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+static __thread struct rseq percpu_own_rseq;
+static __thread volatile struct rseq *percpu_rs;
+static __thread int percpu_registered; /* 1 with rseq, -1 without. */
+
+/* Register the calling thread's rseq area. Return 0 if rseq is usable. */
+static inline int percpu_thread_init(void)
+{
+    if (percpu_registered)
+        return percpu_registered > 0 ? 0 : -1;
+    if (&__rseq_size && __rseq_size > 0) {
+        char *tp;
+
+        asm("mov %%fs:0, %0" : "=r"(tp));
+        percpu_rs = (struct rseq *)(tp + __rseq_offset);
+    } else if (syscall(__NR_rseq, &percpu_own_rseq, 32, 0, PERCPU_RSEQ_SIG) == 0) {
+        percpu_rs = &percpu_own_rseq;
+    }
+    percpu_registered = percpu_rs ? 1 : -1;
+    return percpu_registered > 0 ? 0 : -1;
+}
+
+static int percpu_ncpus(void)
+{
+    int n = get_nprocs_conf();
+
+    return n > 0 ? n : 1;
+}
+
+/* The thread's rseq area, registering it first. A structure in rseq mode
+ * can't fall back per thread. */
+static inline volatile struct rseq *percpu_rseq(void)
+{
+    if (!percpu_rs && percpu_thread_init() != 0)
+        abort();
+    return percpu_rs;
+}
+
+static inline int percpu_getcpu(void)
+{
+    int cpu = sched_getcpu();
+
+    return cpu < 0 ? 0 : cpu;
+}
+
+/* Restartable sequence descriptor and abort handler, the handler is
+ * preceded by the signature the kernel checks. */
+#define PERCPU_RSEQ_CS(start, commit, abort_ip, abort_label)            \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                \
+    ".balign 32\n\t"                                                    \
+    "3:\n\t"                                                            \
+    ".long 0, 0\n\t"                                                    \
+    ".quad " #start "f, (" #commit "f - " #start "f), " #abort_ip "f\n\t" \
+    ".popsection\n\t"                                                   \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                           \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                        \
+    ".long 0x53053053\n\t"                                              \
+    #abort_ip ":\n\t"                                                   \
+    "jmp %l[" #abort_label "]\n\t"                                      \
+    ".popsection\n\t"                                                   \
+    "leaq 3b(%%rip), %%rax\n\t"                                         \
+    "movq %%rax, %[rseq_cs]\n\t"
+
+/* *v = newv if *v == expect, on cpu. Return 0 on success, 1 on mismatch or
+ * abort. */
+static inline int percpu_rseq_cmpeqv_storev(intptr_t *v, intptr_t expect,
+        intptr_t newv, int cpu)
+{
+    volatile struct rseq *rs = percpu_rs;
+
+    asm goto(
+        PERCPU_RSEQ_CS(1, 2, 4, retry)
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz %l[retry]\n\t"
+        "cmpq %[v], %[expect]\n\t"
+        "jnz %l[retry]\n\t"
+        "movq %[newv], %[v]\n\t"
+        "2:\n\t"
+        :
+        : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id), [rseq_cs] "m"(rs->rseq_cs),
+          [v] "m"(*v), [expect] "r"(expect), [newv] "r"(newv)
+        : "memory", "cc", "rax"
+        : retry);
+    return 0;
+retry:
+    return 1;
+}
+
+/* Pop the list at *top on cpu into *obj. Return 0 on success, 1 if the list
+ * is empty, -1 on abort. */
+static inline int percpu_rseq_pop(void **top, void **obj, int cpu)
+{
+    volatile struct rseq *rs = percpu_rs;
+
+    asm goto(
+        PERCPU_RSEQ_CS(1, 2, 4, retry)
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz %l[retry]\n\t"
+        "movq %[top], %%rbx\n\t"
+        "testq %%rbx, %%rbx\n\t"
+        "jz %l[empty]\n\t"
+        "movq (%%rbx), %%rcx\n\t"
+        "movq %%rbx, %[obj]\n\t"
+        "movq %%rcx, %[top]\n\t"
+        "2:\n\t"
+        :
+        : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id), [rseq_cs] "m"(rs->rseq_cs),
+          [top] "m"(*top), [obj] "m"(*obj)
+        : "memory", "cc", "rax", "rbx", "rcx"
+        : retry, empty);
+    return 0;
+empty:
+    return 1;
+retry:
+    return -1;
+}
+
+struct percpu_slot {
+    intptr_t v;
+} __attribute__((aligned(64)));
+
+struct percpu_counter {
+    volatile intptr_t count; /* Folded deltas. */
+    intptr_t batch;
+    int rseq;
+    int ncpus;
+    struct percpu_slot *slot;
+};
+
+/* Return -1 if memory is short. */
+static inline int percpu_counter_init(struct percpu_counter *c, intptr_t batch,
+        int flags)
+{
+    c->count = 0;
+    c->batch = batch > 0 ? batch : 1;
+    c->rseq = !(flags & PERCPU_ATOMIC) && percpu_thread_init() == 0;
+    c->ncpus = percpu_ncpus();
+    if (posix_memalign((void **)&c->slot, 64, c->ncpus * sizeof(*c->slot)) != 0)
+        return -1;
+    for (int i = 0; i < c->ncpus; i++)
+        c->slot[i].v = 0;
+    return 0;
+}
+
+static inline void percpu_counter_destroy(struct percpu_counter *c)
+{
+    free(c->slot);
+    c->slot = NULL;
+}
+
+static inline void percpu_counter_add(struct percpu_counter *c, intptr_t n)
+{
+    intptr_t old, new, spill;
+
+    if (!c->rseq) {
+        struct percpu_slot *s = &c->slot[percpu_getcpu() % c->ncpus];
+
+        new = __sync_add_and_fetch(&s->v, n);
+        if ((new >= c->batch || new <= -c->batch) &&
+            __sync_bool_compare_and_swap(&s->v, new, 0))
+            __sync_fetch_and_add(&c->count, new);
+        return;
+    }
+
+    volatile struct rseq *rs = percpu_rseq();
+
+    while (1) {
+        int cpu = rs->cpu_id_start;
+        intptr_t *v = &c->slot[cpu % c->ncpus].v;
+
+        old = *(volatile intptr_t *)v;
+        new = old + n;
+        spill = 0;
+        if (new >= c->batch || new <= -c->batch) {
+            spill = new;
+            new = 0;
+        }
+        if (percpu_rseq_cmpeqv_storev(v, old, new, cpu) == 0)
+            break;
+    }
+    if (spill)
+        __sync_fetch_and_add(&c->count, spill);
+}
+
+/* Approximate value, one load. */
+static inline intptr_t percpu_counter_read(const struct percpu_counter *c)
+{
+    return c->count;
+}
+
+/* Exact value, reads every CPU's slot. */
+static inline intptr_t percpu_counter_sum(const struct percpu_counter *c)
+{
+    intptr_t sum = c->count;
+
+    for (int i = 0; i < c->ncpus; i++)
+        sum += *(volatile intptr_t *)&c->slot[i].v;
+    return sum;
+}
+
+struct percpu_head {
+    void *top;
+    volatile unsigned char lock; /* Atomic mode only. */
+} __attribute__((aligned(64)));
+
+struct percpu_stack {
+    int rseq;
+    int ncpus;
+    struct percpu_head *head;
+};
+
+/* Return -1 if memory is short. */
+static inline int percpu_stack_init(struct percpu_stack *s, int flags)
+{
+    s->rseq = !(flags & PERCPU_ATOMIC) && percpu_thread_init() == 0;
+    s->ncpus = percpu_ncpus();
+    if (posix_memalign((void **)&s->head, 64, s->ncpus * sizeof(*s->head)) != 0)
+        return -1;
+    for (int i = 0; i < s->ncpus; i++) {
+        s->head[i].top = NULL;
+        s->head[i].lock = 0;
+    }
+    return 0;
+}
+
+static inline void percpu_stack_destroy(struct percpu_stack *s)
+{
+    free(s->head);
+    s->head = NULL;
+}
+
+static inline struct percpu_head *percpu_stack_lock(struct percpu_stack *s)
+{
+    struct percpu_head *h = &s->head[percpu_getcpu() % s->ncpus];
+
+    while (__sync_lock_test_and_set(&h->lock, 1))
+        while (h->lock) cpu_relax();
+    return h;
+}
+
+static inline void percpu_stack_push(struct percpu_stack *s, void *obj)
+{
+    if (!s->rseq) {
+        struct percpu_head *h = percpu_stack_lock(s);
+
+        *(void **)obj = h->top;
+        h->top = obj;
+        __sync_lock_release(&h->lock);
+        return;
+    }
+
+    volatile struct rseq *rs = percpu_rseq();
+
+    while (1) {
+        int cpu = rs->cpu_id_start;
+        struct percpu_head *h = &s->head[cpu % s->ncpus];
+        void *old = *(void *volatile *)&h->top;
+
+        /* obj is private until the commit, a stale link is rewritten on
+         * retry. */
+        *(void **)obj = old;
+        if (percpu_rseq_cmpeqv_storev((intptr_t *)&h->top, (intptr_t)old,
+                    (intptr_t)obj, cpu) == 0)
+            return;
+    }
+}
+
+/* Pop from the current CPU's list, NULL if it is empty. */
+static inline void *percpu_stack_pop(struct percpu_stack *s)
+{
+    void *obj;
+
+    if (!s->rseq) {
+        struct percpu_head *h = percpu_stack_lock(s);
+
+        obj = h->top;
+        if (obj)
+            h->top = *(void **)obj;
+        __sync_lock_release(&h->lock);
+        return obj;
+    }
+
+    volatile struct rseq *rs = percpu_rseq();
+
+    while (1) {
+        int cpu = rs->cpu_id_start;
+        int r = percpu_rseq_pop(&s->head[cpu % s->ncpus].top, &obj, cpu);
+
+        if (r == 0)
+            return obj;
+        if (r > 0)
+            return NULL;
+    }
+}
+
+/* Take the whole list of CPU i. Only while no thread uses the stack. */
+static inline void *percpu_stack_drain(struct percpu_stack *s, int i)
+{
+    void *top = s->head[i].top;
+
+    s->head[i].top = NULL;
+    return top;
+}
+
+#endif /* _PERCPU_H */
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <cpuid.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perf.h"
+
+/* Raw event for loads hitting a modified line in another core's cache,
+ * MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM (event 0xd2, umask 0x04) on Intel cores
+ * since Sandy Bridge, renamed XSNP_FWD on later ones. */
+#define INTEL_HITM 0x04d2
+
+const char *const perf_ev_names[PERF_NEV] = {
+    "cycles", "instructions", "llc_misses", "l1d_misses", "hitm",
+    "task_clock", "ctx_switches", "migrations",
+};
+
+static struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERF_NEV] = {
+    [PERF_EV_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [PERF_EV_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [PERF_EV_LLC_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [PERF_EV_L1D_MISSES] = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    [PERF_EV_HITM] = { PERF_TYPE_RAW, 0 },
+    [PERF_EV_TASK_CLOCK] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    [PERF_EV_CTX_SWITCHES] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    [PERF_EV_MIGRATIONS] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+};
+
+static int usable[PERF_NEV];
+
+static int is_hw(int e) {
+    return events[e].type != PERF_TYPE_SOFTWARE;
+}
+
+static int open_event(int e, int group) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[e].type;
+    attr.config = events[e].config;
+    attr.disabled = group < 0;
+    /* Software events fire in the kernel, only hardware ones are limited to
+     * user space. */
+    attr.exclude_kernel = is_hw(e);
+    attr.exclude_hv = is_hw(e);
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+        PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static uint64_t cpu_hitm(void) {
+    unsigned eax, ebx, ecx, edx;
+    char vendor[13];
+
+    if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    memcpy(vendor, &ebx, 4);
+    memcpy(vendor + 4, &edx, 4);
+    memcpy(vendor + 8, &ecx, 4);
+    vendor[12] = '\0';
+    if (strcmp(vendor, "GenuineIntel") != 0 ||
+        !__get_cpuid(1, &eax, &ebx, &ecx, &edx) || ((eax >> 8) & 0xf) != 6)
+        return 0;
+    return INTEL_HITM;
+}
+
+int perf_setup(uint64_t hitm) {
+    int n = 0, nhw = 0, err = 0;
+
+    events[PERF_EV_HITM].config = hitm ? hitm : cpu_hitm();
+    for (int e = 0; e < PERF_NEV; e++) {
+        int fd;
+
+        if (e == PERF_EV_HITM && !events[e].config)
+            continue;
+        fd = open_event(e, -1);
+        if (fd < 0) {
+            if (!err)
+                err = errno;
+            continue;
+        }
+        close(fd);
+        usable[e] = 1;
+        n++;
+        nhw += is_hw(e);
+    }
+    if (n == 0)
+        fprintf(stderr, "perf: no counters: %s\n", strerror(err));
+    else if (nhw == 0)
+        fprintf(stderr, "perf: no hardware counters (%s), "
+                "using software events\n", strerror(err));
+    else if (!usable[PERF_EV_HITM])
+        fprintf(stderr, "perf: no HITM event for this CPU, "
+                "give one with --perf-hitm\n");
+    return n;
+}
+
+void perf_open(struct perf_thread *p) {
+    int hw = -1, sw = -1;
+
+    for (int e = 0; e < PERF_NEV; e++) {
+        int *leader = is_hw(e) ? &hw : &sw;
+
+        p->fd[e] = -1;
+        if (!usable[e])
+            continue;
+        /* Members follow the leader's enable state. */
+        p->fd[e] = open_event(e, *leader);
+        if (p->fd[e] >= 0 && *leader < 0)
+            *leader = p->fd[e];
+    }
+}
+
+static void group_ioctl(struct perf_thread *p, unsigned long req) {
+    int hw = 0, sw = 0;
+
+    for (int e = 0; e < PERF_NEV; e++) {
+        int *done = is_hw(e) ? &hw : &sw;
+
+        if (p->fd[e] < 0 || *done)
+            continue;
+        ioctl(p->fd[e], req, PERF_IOC_FLAG_GROUP);
+        *done = 1;
+    }
+}
+
+void perf_enable(struct perf_thread *p) {
+    group_ioctl(p, PERF_EVENT_IOC_ENABLE);
+}
+
+void perf_disable(struct perf_thread *p) {
+    group_ioctl(p, PERF_EVENT_IOC_DISABLE);
+}
+
+void perf_close(struct perf_thread *p) {
+    for (int e = 0; e < PERF_NEV; e++) {
+        uint64_t buf[3]; /* value, time enabled, time running */
+
+        p->vals.v[e] = 0;
+        p->vals.valid[e] = 0;
+        if (p->fd[e] < 0)
+            continue;
+        /* A group which never got on the PMU has not run at all. */
+        if (read(p->fd[e], buf, sizeof(buf)) == sizeof(buf) && buf[2] > 0) {
+            p->vals.v[e] = buf[2] < buf[1] ?
+                (uint64_t)((double)buf[0] * buf[1] / buf[2]) : buf[0];
+            p->vals.valid[e] = 1;
+        }
+        close(p->fd[e]);
+        p->fd[e] = -1;
+    }
+}
+
+void perf_values_init(struct perf_values *v) {
+    for (int e = 0; e < PERF_NEV; e++) {
+        v->v[e] = 0;
+        v->valid[e] = 1;
+    }
+}
+
+void perf_add(struct perf_values *to, const struct perf_values *from) {
+    for (int e = 0; e < PERF_NEV; e++) {
+        to->v[e] += from->v[e];
+        to->valid[e] &= from->valid[e];
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef _PERF_H
+#define _PERF_H
+
+/* Per thread performance counters read with perf_event_open(2), counting only
+ * the calling thread on any CPU.
+ *
+ * Hardware events are opened as one group so they are scheduled on the PMU
+ * together, software events as a second group. Events the kernel or CPU
+ * don't provide are left out, in a VM without a virtual PMU only the software
+ * events remain. A group which had to share the PMU with other users is
+ * scaled by the time it was enabled over the time it ran. */
+
+#include <stdint.h>
+
+enum perf_ev {
+    /* Hardware. */
+    PERF_EV_CYCLES,
+    PERF_EV_INSTRUCTIONS,
+    PERF_EV_LLC_MISSES,
+    PERF_EV_L1D_MISSES, /* L1D read misses. */
+    PERF_EV_HITM,       /* Loads served by a modified line of another core. */
+    /* Software. */
+    PERF_EV_TASK_CLOCK, /* ns on CPU. */
+    PERF_EV_CTX_SWITCHES,
+    PERF_EV_MIGRATIONS,
+    PERF_NEV
+};
+
+/* Counter values. An event is valid if it was opened and counted. */
+struct perf_values {
+    uint64_t v[PERF_NEV];
+    int valid[PERF_NEV];
+};
+
+struct perf_thread {
+    int fd[PERF_NEV]; /* -1 if not opened. */
+    struct perf_values vals;
+};
+
+extern const char *const perf_ev_names[PERF_NEV];
+
+/* Find out once which events can be opened and warn on stderr about missing
+ * ones. hitm is the raw config of the HITM event, 0 picks the one of the CPU
+ * if known. Return the number of usable events. */
+int perf_setup(uint64_t hitm);
+
+/* Open the usable events for the calling thread, disabled. */
+void perf_open(struct perf_thread *p);
+void perf_enable(struct perf_thread *p);
+void perf_disable(struct perf_thread *p);
+/* Read the events into p->vals and close them. */
+void perf_close(struct perf_thread *p);
+
+/* All zero and valid, to sum threads with perf_add. */
+void perf_values_init(struct perf_values *v);
+/* to += from, an event stays valid only if it is valid in both. */
+void perf_add(struct perf_values *to, const struct perf_values *from);
+
+#endif /* _PERF_H */
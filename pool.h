@@ -0,0 +1,186 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+/* Per thread pool allocator for fixed size objects.
+ *
+ * Every thread owns a pool_cache and carves objects out of its own slabs.
+ * Objects are rounded up so they never straddle a cache line: sizes up to a
+ * line become a power of two, larger ones a multiple of the line size.
+ *
+ * Slabs are POOL_SLAB_SIZE aligned and start with a pointer to the owning
+ * cache, so pool_free finds the owner by masking the address. An object freed
+ * by its owner goes to the owner's local freelist. Objects freed by another
+ * thread are collected in a batch of up to POOL_BATCH objects for the same
+ * owner and handed over with one CAS onto the owner's remote list. The owner
+ * takes the whole remote list with an xchg when its local list runs dry, so
+ * the remote list is never popped one by one and has no ABA problem.
+ *
+ * Slabs are only released by pool_destroy. The memory stays a valid object
+ * of the same type while the pool is alive, which lets lock-free structures
+ * read fields of an object another thread already freed. A free object's
+ * first word is used as freelist link. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef POOL_SLAB_SIZE
+#define POOL_SLAB_SIZE (64 * 1024)
+#endif
+#ifndef POOL_BATCH
+#define POOL_BATCH 32
+#endif
+#define POOL_LINE 64
+
+struct pool_obj {
+    struct pool_obj *next;
+};
+
+struct pool_cache {
+    /* Owner only. */
+    struct pool_obj *local;
+    char *bump, *bump_end; /* Unused part of the newest slab. */
+    void *slabs;           /* Slabs of this cache, linked through word 1. */
+
+    /* Objects of another cache freed by the owner, not yet handed over. */
+    struct pool_cache *batch_owner;
+    struct pool_obj *batch_head, *batch_tail;
+    int batch_n;
+
+    struct pool_cache *next_cache;
+
+    /* Written by other threads. */
+    struct pool_obj *volatile remote __attribute__((aligned(POOL_LINE)));
+} __attribute__((aligned(POOL_LINE)));
+
+struct pool {
+    size_t size;
+    struct pool_cache *volatile caches;
+};
+
+static inline size_t pool_round(size_t size)
+{
+    size_t s = sizeof(struct pool_obj);
+
+    if (size > POOL_LINE)
+        return (size + POOL_LINE - 1) & ~(size_t)(POOL_LINE - 1);
+    while (s < size)
+        s <<= 1;
+    return s;
+}
+
+/* Return -1 if objects of size don't fit a slab. */
+static inline int pool_init(struct pool *p, size_t size)
+{
+    p->size = pool_round(size);
+    p->caches = NULL;
+    return p->size > POOL_SLAB_SIZE - POOL_LINE ? -1 : 0;
+}
+
+/* Create the calling thread's cache. */
+static inline struct pool_cache *pool_thread_init(struct pool *p)
+{
+    struct pool_cache *c;
+
+    if (posix_memalign((void **)&c, POOL_LINE, sizeof(*c)) != 0)
+        return NULL;
+    memset(c, 0, sizeof(*c));
+    do {
+        c->next_cache = p->caches;
+    } while (!__sync_bool_compare_and_swap(&p->caches, c->next_cache, c));
+    return c;
+}
+
+static inline int pool_new_slab(struct pool_cache *c)
+{
+    void **slab;
+
+    if (posix_memalign((void **)&slab, POOL_SLAB_SIZE, POOL_SLAB_SIZE) != 0)
+        return -1;
+    slab[0] = c;
+    slab[1] = c->slabs;
+    c->slabs = slab;
+    /* The first line holds the slab header. */
+    c->bump = (char *)slab + POOL_LINE;
+    c->bump_end = (char *)slab + POOL_SLAB_SIZE;
+    return 0;
+}
+
+static inline void *pool_alloc(struct pool *p, struct pool_cache *c)
+{
+    struct pool_obj *o = c->local;
+
+    if (o == NULL && c->remote != NULL)
+        o = __sync_lock_test_and_set(&c->remote, NULL);
+    if (o != NULL) {
+        c->local = o->next;
+        return o;
+    }
+    if (c->bump + p->size > c->bump_end && pool_new_slab(c) != 0)
+        return NULL;
+    o = (struct pool_obj *)c->bump;
+    c->bump += p->size;
+    return o;
+}
+
+static inline struct pool_cache *pool_owner(void *obj)
+{
+    return *(struct pool_cache **)((uintptr_t)obj & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+}
+
+/* Hand the pending remote batch over to its owner. */
+static inline void pool_flush(struct pool_cache *c)
+{
+    struct pool_cache *owner = c->batch_owner;
+    struct pool_obj *head;
+
+    if (c->batch_n == 0)
+        return;
+    do {
+        head = owner->remote;
+        c->batch_tail->next = head;
+    } while (!__sync_bool_compare_and_swap(&owner->remote, head, c->batch_head));
+    c->batch_owner = NULL;
+    c->batch_head = c->batch_tail = NULL;
+    c->batch_n = 0;
+}
+
+static inline void pool_free(struct pool_cache *c, void *obj)
+{
+    struct pool_cache *owner = pool_owner(obj);
+    struct pool_obj *o = obj;
+
+    if (owner == c) {
+        o->next = c->local;
+        c->local = o;
+        return;
+    }
+    if (owner != c->batch_owner) {
+        pool_flush(c);
+        c->batch_owner = owner;
+        c->batch_tail = o;
+    }
+    o->next = c->batch_head;
+    c->batch_head = o;
+    if (++c->batch_n == POOL_BATCH)
+        pool_flush(c);
+}
+
+/* Release all slabs and caches. No thread may use the pool any more. */
+static inline void pool_destroy(struct pool *p)
+{
+    struct pool_cache *c, *next_cache;
+    void **slab, *next;
+
+    for (c = p->caches; c != NULL; c = next_cache) {
+        next_cache = c->next_cache;
+        for (slab = c->slabs; slab != NULL; slab = next) {
+            next = slab[1];
+            free(slab);
+        }
+        free(c);
+    }
+    p->caches = NULL;
+}
+
+#endif /* _POOL_H */
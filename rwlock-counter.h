@@ -0,0 +1,79 @@
+#ifndef _RWLOCK_COUNTER_H
+#define _RWLOCK_COUNTER_H
+
+/* Counter based reader-writer spin lock preferring writers.
+ * Code copied from http://locklessinc.com/articles/locks/
+ *
+ * Bit 0 is set by a waiting writer to stop new readers, bit 1 is the writer
+ * and the remaining bits count readers. */
+
+#define atomic_xadd(P, V) __sync_fetch_and_add((P), (V))
+#define cmpxchg(P, O, N) __sync_val_compare_and_swap((P), (O), (N))
+#define atomic_add(P, V) __sync_add_and_fetch((P), (V))
+#define atomic_set_bit(P, V) __sync_or_and_fetch((P), 1<<(V))
+
+#define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+#define RW_WAIT_BIT     0
+#define RW_WRITE_BIT    1
+#define RW_READ_BIT     2
+
+#define RW_WAIT     1
+#define RW_WRITE    2
+#define RW_READ     4
+
+typedef unsigned rwcounter;
+
+static inline void rwcounter_write_lock(rwcounter *l)
+{
+    while (1)
+    {
+        unsigned state = *(volatile unsigned *)l;
+
+        /* No readers or writers? */
+        if (state < RW_WRITE)
+        {
+            /* Turn off RW_WAIT, and turn on RW_WRITE */
+            if (cmpxchg(l, state, RW_WRITE) == state) return;
+
+            /* Someone else got there... time to wait */
+            state = *(volatile unsigned *)l;
+        }
+
+        /* Turn on writer wait bit */
+        if (!(state & RW_WAIT)) atomic_set_bit(l, RW_WAIT_BIT);
+
+        /* Wait until can try to take the lock */
+        while (*(volatile unsigned *)l > RW_WAIT) cpu_relax();
+    }
+}
+
+static inline void rwcounter_write_unlock(rwcounter *l)
+{
+    atomic_add(l, -RW_WRITE);
+}
+
+static inline void rwcounter_read_lock(rwcounter *l)
+{
+    while (1)
+    {
+        /* A writer exists? */
+        while (*(volatile unsigned *)l & (RW_WAIT | RW_WRITE)) cpu_relax();
+
+        /* Try to get read lock */
+        if (!(atomic_xadd(l, RW_READ) & (RW_WAIT | RW_WRITE))) return;
+
+        /* Undo */
+        atomic_add(l, -RW_READ);
+    }
+}
+
+static inline void rwcounter_read_unlock(rwcounter *l)
+{
+    atomic_add(l, -RW_READ);
+}
+
+#endif /* _RWLOCK_COUNTER_H */
@@ -0,0 +1,87 @@
+#ifndef _RWLOCK_PERCPU_H
+#define _RWLOCK_PERCPU_H
+
+/* Per-CPU (big reader) reader-writer lock.
+ *
+ * Every CPU has a reader count on its own cache line. A reader only writes
+ * the count of its CPU and reads the writer flag, which stays shared in every
+ * cache as long as no writer comes along. Read side cost is independent of the
+ * number of readers. A writer sets the flag and then waits for the count of
+ * every CPU to drop to zero, so writes get more expensive with the number of
+ * slots. Writers have priority, readers back off while the flag is set.
+ *
+ * A thread keeps using the slot of the CPU it first ran on, so unlock always
+ * decrements the count it incremented even if the thread migrated. */
+
+#include <sched.h>
+
+#define atomic_xadd(P, V) __sync_fetch_and_add((P), (V))
+
+#define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+#ifndef PERCPU_RW_SLOTS
+#define PERCPU_RW_SLOTS 64
+#endif
+
+typedef struct rwpercpu_slot rwpercpu_slot;
+struct rwpercpu_slot
+{
+    volatile int readers;
+} __attribute__((aligned(64)));
+
+typedef struct rwpercpu rwpercpu;
+struct rwpercpu
+{
+    volatile unsigned char writer __attribute__((aligned(64)));
+    rwpercpu_slot slot[PERCPU_RW_SLOTS];
+};
+
+static __thread int rwpercpu_my_slot = -1;
+
+static inline rwpercpu_slot *rwpercpu_slot_of(rwpercpu *l)
+{
+    if (rwpercpu_my_slot < 0) {
+        int cpu = sched_getcpu();
+        rwpercpu_my_slot = (cpu < 0 ? 0 : cpu) % PERCPU_RW_SLOTS;
+    }
+    return &l->slot[rwpercpu_my_slot];
+}
+
+static inline void rwpercpu_read_lock(rwpercpu *l)
+{
+    rwpercpu_slot *s = rwpercpu_slot_of(l);
+
+    while (1) {
+        /* Locked add is a full barrier, the writer check can't move above. */
+        atomic_xadd(&s->readers, 1);
+        if (!l->writer) return;
+
+        atomic_xadd(&s->readers, -1);
+        while (l->writer) cpu_relax();
+    }
+}
+
+static inline void rwpercpu_read_unlock(rwpercpu *l)
+{
+    atomic_xadd(&rwpercpu_slot_of(l)->readers, -1);
+}
+
+static inline void rwpercpu_write_lock(rwpercpu *l)
+{
+    while (__sync_lock_test_and_set(&l->writer, 1))
+        while (l->writer) cpu_relax();
+
+    for (int i = 0; i < PERCPU_RW_SLOTS; i++)
+        while (l->slot[i].readers) cpu_relax();
+}
+
+static inline void rwpercpu_write_unlock(rwpercpu *l)
+{
+    barrier();
+    l->writer = 0;
+}
+
+#endif /* _RWLOCK_PERCPU_H */
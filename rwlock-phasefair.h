@@ -0,0 +1,70 @@
+#ifndef _RWLOCK_PHASEFAIR_H
+#define _RWLOCK_PHASEFAIR_H
+
+/* Phase-fair ticket reader-writer lock (PF-T) from "Reader-Writer
+ * Synchronization for Shared-Memory Multiprocessor Real-Time Systems" by
+ * Brandenburg and Anderson.
+ *
+ * Reader and writer phases alternate: a reader arriving while a writer holds
+ * or waits for the lock enters right after that writer, and a writer waits for
+ * at most one reader phase. Neither side can starve the other.
+ *
+ * The low byte of rin holds the writer present bit and the phase id, readers
+ * count in the upper bits. Writers are ordered by the win/wout tickets. */
+
+#define atomic_xadd(P, V) __sync_fetch_and_add((P), (V))
+
+#define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+#define PF_RINC  0x100 /* Reader increment. */
+#define PF_WBITS 0x3   /* Writer bits in rin. */
+#define PF_PRES  0x2   /* Writer present. */
+#define PF_PHID  0x1   /* Phase id. */
+
+typedef struct rwphasefair rwphasefair;
+struct rwphasefair
+{
+    volatile unsigned rin;
+    volatile unsigned rout;
+    volatile unsigned win;
+    volatile unsigned wout;
+};
+
+static inline void rwphasefair_read_lock(rwphasefair *l)
+{
+    unsigned w = atomic_xadd(&l->rin, PF_RINC) & PF_WBITS;
+
+    /* Wait for the current writer phase to end. */
+    if (w) while (w == (l->rin & PF_WBITS)) cpu_relax();
+}
+
+static inline void rwphasefair_read_unlock(rwphasefair *l)
+{
+    atomic_xadd(&l->rout, PF_RINC);
+}
+
+static inline void rwphasefair_write_lock(rwphasefair *l)
+{
+    unsigned ticket, w, rticket;
+
+    /* Wait for earlier writers. */
+    ticket = atomic_xadd(&l->win, 1);
+    while (ticket != l->wout) cpu_relax();
+
+    /* Block new readers and wait for those already in. */
+    w = PF_PRES | (ticket & PF_PHID);
+    rticket = atomic_xadd(&l->rin, w);
+    while (rticket != l->rout) cpu_relax();
+}
+
+static inline void rwphasefair_write_unlock(rwphasefair *l)
+{
+    __sync_fetch_and_and(&l->rin, ~PF_WBITS);
+    barrier();
+    l->wout++;
+}
+
+#endif /* _RWLOCK_PHASEFAIR_H */
@@ -0,0 +1,72 @@
+#ifndef _RWLOCK_TICKET_H
+#define _RWLOCK_TICKET_H
+
+/* Fair reader-writer ticket lock, based on the rwticket lock from
+ * http://locklessinc.com/articles/locks/
+ *
+ * Readers and writers take a ticket from users and are served in order.
+ * Consecutive readers are admitted together: a reader entering bumps read so
+ * the next reader may follow, a writer waits until every earlier reader has
+ * bumped write on unlock. The counters are 16 bits wide instead of 8 in the
+ * original so up to 65535 threads can wait without wrapping. */
+
+#include <stdint.h>
+
+#define atomic_xadd(P, V) __sync_fetch_and_add((P), (V))
+#define atomic_inc(P) __sync_add_and_fetch((P), 1)
+
+#define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+typedef union rwticket rwticket;
+
+union rwticket
+{
+    uint64_t u;
+    uint32_t wr; /* write and read together */
+    struct
+    {
+        uint16_t write;
+        uint16_t read;
+        uint16_t users;
+    } s;
+};
+
+static inline void rwticket_write_lock(rwticket *l)
+{
+    uint64_t me = atomic_xadd(&l->u, (uint64_t)1 << 32);
+    uint16_t val = me >> 32;
+
+    while (val != ((volatile rwticket *)l)->s.write) cpu_relax();
+}
+
+static inline void rwticket_write_unlock(rwticket *l)
+{
+    rwticket t = *(volatile rwticket *)l;
+
+    barrier();
+
+    t.s.write++;
+    t.s.read++;
+
+    /* Update write and read in one store, leave users alone. */
+    *(volatile uint32_t *)&l->wr = t.wr;
+}
+
+static inline void rwticket_read_lock(rwticket *l)
+{
+    uint64_t me = atomic_xadd(&l->u, (uint64_t)1 << 32);
+    uint16_t val = me >> 32;
+
+    while (val != ((volatile rwticket *)l)->s.read) cpu_relax();
+    ((volatile rwticket *)l)->s.read++;
+}
+
+static inline void rwticket_read_unlock(rwticket *l)
+{
+    atomic_inc(&l->s.write);
+}
+
+#endif /* _RWLOCK_TICKET_H */
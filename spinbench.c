@@ -0,0 +1,959 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <getopt.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <math.h>
+#include "bench.h"
+#include "hist.h"
+#include "tsc.h"
+#include "backoff.h"
+#include "topology.h"
+#include "lockstat.h"
+#include "perf.h"
+#include "work.h"
+
+/* Benchmark driver. Runs every selected lock with every thread count and
+ * prints one CSV or JSON row for each run. */
+
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+
+#define MAX_SWEEP 64
+
+#define TIMEOUT_NS 10000
+
+/* Default backoff budgets. */
+#define BACKOFF_MIN_NS 50
+#define BACKOFF_MAX_NS 5000
+
+enum { FORMAT_CSV, FORMAT_JSON };
+
+static struct {
+    const struct bench_lock *locks[BENCH_MAX_LOCKS];
+    int nlocks;
+    int threads[MAX_SWEEP];
+    int nthreads;
+    long ops;
+    int repeat;
+    int format;
+    int latency;
+    int perf;       /* Report performance counters per operation. */
+    uint64_t perf_hitm;
+    int lock_stats; /* Some selected lock has internal counters. */
+    double duration; /* Seconds for time bounded runs, 0 for fixed ops. */
+
+    /* Workload, cs_lines and think_ns are swept like threads. */
+    int cs_lines[MAX_SWEEP];
+    int ncs_lines;
+    int think_ns[MAX_SWEEP];
+    int nthink_ns;
+    int cs_shared;
+    int cs_write;
+    int think_random;
+    int read_pct[MAX_SWEEP];
+    int nread_pct;
+
+    /* Backoff policies, every kind with every min and max. Columns for them
+     * are only printed with --backoff. */
+    int backoff[MAX_SWEEP];
+    int nbackoff;
+    int backoff_min[MAX_SWEEP];
+    int nbackoff_min;
+    int backoff_max[MAX_SWEEP];
+    int nbackoff_max;
+    int backoff_set;
+
+    /* Thread count of each phase of a phased run, each lasting duration. */
+    int phases[MAX_SWEEP];
+    int nphases;
+    int phase_max;
+
+    /* Percentage of waiters giving up after timeout_ns. Columns for them
+     * are only printed with --timeout-pct. */
+    int timeout_pct[MAX_SWEEP];
+    int ntimeout_pct;
+    long timeout_ns;
+    int timeout_set;
+
+    enum placement placement;
+    const char *placement_name;
+    int *cpu_list; /* For PLACE_LIST. */
+    int ncpu_list;
+} opt;
+
+static struct topology topo;
+/* CPU for each thread id, repeated when there are more threads than CPUs. */
+static int *place_order;
+static int nplace_order;
+
+/* TSC ticks per ns, calibrated at startup. */
+static double tsc_per_ns;
+
+/* Backoff policy of the current run, in ns. */
+static struct {
+    int kind;
+    int min_ns;
+    int max_ns;
+} cur_backoff;
+
+static int nthr = 0;
+
+static volatile uint32_t wflag;
+/* Count finished threads separately. Reusing wflag would let a fast thread
+ * decrement it before a slow one has seen it reach nthr. */
+static volatile uint32_t eflag;
+/* Wait on a flag to make all threads start almost at the same time. */
+static void wait_flag(volatile uint32_t *flag, uint32_t expect) {
+    __sync_fetch_and_add((uint32_t *)flag, 1);
+    while (*flag != expect) {
+        cpu_relax();
+    }
+}
+
+static struct timespec start_time;
+static struct timespec end_time;
+
+void bench_thread_start(struct bench_thread *t) {
+    if (t->perf)
+        perf_open(t->perf);
+    wait_flag(&wflag, nthr);
+
+    if (t->id == 0)
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+    if (t->perf)
+        perf_enable(t->perf);
+}
+
+void bench_thread_end(struct bench_thread *t) {
+    if (t->perf) {
+        perf_disable(t->perf);
+        perf_close(t->perf);
+    }
+    if (__sync_add_and_fetch((uint32_t *)&eflag, 1) == (uint32_t)nthr)
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+}
+
+struct result {
+    double sec;
+    long ops;
+    /* Merged histograms of all threads, only with --latency. */
+    struct hist *acquire;
+    struct hist *hold;
+    /* Counters summed over all threads, only with --perf. */
+    struct perf_values perf;
+
+    /* Fairness of time bounded runs. */
+    long acq_min, acq_max;
+    double acq_stddev;
+    long timeouts;
+    double jain;        /* Jain's fairness index, 1 means perfectly fair. */
+    long max_streak;
+    uint64_t max_wait;  /* TSC ticks. */
+
+    /* Phased runs, filled for every phase. */
+    double phase_sec[MAX_SWEEP];
+    long phase_ops[MAX_SWEEP];
+    int phase;          /* Phase of this row. */
+};
+
+static volatile int stop_flag;
+static volatile int phase;
+
+/* Fill the fairness fields of res from the per thread acquisition counts. */
+static void calc_fairness(struct bench_thread *arg, int n, struct result *res) {
+    double sum = 0, sum2 = 0, mean;
+
+    res->acq_min = res->acq_max = arg[0].acquired;
+    res->max_wait = 0;
+    for (int i = 0; i < n; i++) {
+        double x = arg[i].acquired;
+        sum += x;
+        sum2 += x * x;
+        if (arg[i].acquired < res->acq_min)
+            res->acq_min = arg[i].acquired;
+        if (arg[i].acquired > res->acq_max)
+            res->acq_max = arg[i].acquired;
+        if (arg[i].max_wait > res->max_wait)
+            res->max_wait = arg[i].max_wait;
+    }
+    mean = sum / n;
+    res->acq_stddev = sqrt(sum2 / n - mean * mean);
+    res->jain = sum2 > 0 ? sum * sum / (n * sum2) : 1;
+}
+
+static int8_t *alloc_lines(int nlines) {
+    int8_t *p;
+
+    if (posix_memalign((void **)&p, CACHE_LINE, (size_t)nlines * CACHE_LINE) != 0) {
+        perror("posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+    memset(p, 0, (size_t)nlines * CACHE_LINE);
+    return p;
+}
+
+/* Switch to the next phase after each duration, the threads pick it up at
+ * their next acquisition. */
+static void run_phases(struct result *res) {
+    struct timespec ts = {
+        (time_t)opt.duration,
+        (long)((opt.duration - (time_t)opt.duration) * 1e9)
+    };
+    struct timespec t0, t1;
+
+    for (int p = 0; p < opt.nphases; p++) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        phase = p;
+        nanosleep(&ts, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        res->phase_sec[p] = calc_time(&t0, &t1);
+    }
+}
+
+/* Run one benchmark, elapsed time in seconds is stored in res. */
+static void run_once(const struct bench_lock *l, int n,
+        const struct bench_work *work, struct result *res) {
+    pthread_t *thr = calloc(n, sizeof(*thr));
+    struct bench_thread *arg = calloc(n, sizeof(*arg));
+    struct bench_fair fair = { -1, 0, 0 };
+    int8_t *shared = alloc_lines(work->cs_lines);
+
+    nthr = n;
+    wflag = 0;
+    eflag = 0;
+    stop_flag = 0;
+    phase = 0;
+    l->init();
+
+    // Spread the remainder so the total is always opt.ops.
+    for (int i = 0; i < n; i++) {
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        arg[i].id = i;
+        arg[i].cpu = -1;
+        if (nplace_order > 0) {
+            cpu_set_t set;
+
+            arg[i].cpu = place_order[i % nplace_order];
+            CPU_ZERO(&set);
+            CPU_SET(arg[i].cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        arg[i].ops = opt.ops / n + (i < opt.ops % n);
+        arg[i].work = work;
+        arg[i].data = work->cs_shared ? shared : alloc_lines(work->cs_lines);
+        if (opt.latency) {
+            arg[i].acquire = hist_new();
+            arg[i].hold = hist_new();
+        }
+        if (opt.perf)
+            arg[i].perf = calloc(1, sizeof(struct perf_thread));
+        if (opt.duration > 0) {
+            arg[i].stop = &stop_flag;
+            arg[i].fair = &fair;
+        }
+        if (opt.nphases) {
+            size_t sz = opt.nphases * sizeof(long);
+
+            arg[i].phase = &phase;
+            arg[i].active = opt.phases;
+            arg[i].phase_acquired =
+                (long *)alloc_lines((sz + CACHE_LINE - 1) / CACHE_LINE);
+        }
+        if (pthread_create(&thr[i], &attr, l->thread, &arg[i]) != 0) {
+            perror("thread creating failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    if (opt.duration > 0) {
+        struct timespec ts = {
+            (time_t)opt.duration,
+            (long)((opt.duration - (time_t)opt.duration) * 1e9)
+        };
+        while (wflag != (uint32_t)n)
+            sched_yield();
+        if (opt.nphases)
+            run_phases(res);
+        else
+            nanosleep(&ts, NULL);
+        stop_flag = 1;
+    }
+    for (int i = 0; i < n; i++)
+        pthread_join(thr[i], NULL);
+
+    res->sec = calc_time(&start_time, &end_time);
+    res->ops = 0;
+    for (int i = 0; i < n; i++) {
+        res->ops += arg[i].acquired;
+        res->timeouts += arg[i].timeouts;
+        if (!work->cs_shared)
+            free(arg[i].data);
+    }
+    free(shared);
+    for (int p = 0; p < opt.nphases; p++) {
+        res->phase_ops[p] = 0;
+        for (int i = 0; i < n; i++)
+            res->phase_ops[p] += arg[i].phase_acquired[p];
+    }
+    for (int i = 0; i < n; i++)
+        free(arg[i].phase_acquired);
+    if (opt.duration > 0) {
+        calc_fairness(arg, n, res);
+        res->max_streak = fair.max_streak;
+    }
+    if (opt.latency) {
+        res->acquire = hist_new();
+        res->hold = hist_new();
+        for (int i = 0; i < n; i++) {
+            hist_merge(res->acquire, arg[i].acquire);
+            hist_merge(res->hold, arg[i].hold);
+            hist_free(arg[i].acquire);
+            hist_free(arg[i].hold);
+        }
+    }
+    if (opt.perf) {
+        perf_values_init(&res->perf);
+        for (int i = 0; i < n; i++) {
+            perf_add(&res->perf, &arg[i].perf->vals);
+            free(arg[i].perf);
+        }
+    }
+
+    free(thr);
+    free(arg);
+}
+
+/* Output rows are built one column at a time. For CSV the header is taken
+ * from the column names of the first row. */
+static char row_keys[1024];
+static char row_vals[1024];
+static int header_done;
+
+static void row_add(const char *key, const char *val, int quote) {
+    size_t kl = strlen(row_keys), vl = strlen(row_vals);
+
+    if (opt.format == FORMAT_CSV) {
+        snprintf(row_keys + kl, sizeof(row_keys) - kl, "%s%s", kl ? "," : "", key);
+        snprintf(row_vals + vl, sizeof(row_vals) - vl, "%s%s", vl ? "," : "", val);
+    } else {
+        snprintf(row_vals + vl, sizeof(row_vals) - vl, "%s\"%s\":%s%s%s",
+                 vl ? "," : "", key, quote ? "\"" : "", val, quote ? "\"" : "");
+    }
+}
+
+static void row_str(const char *key, const char *val) {
+    row_add(key, val, 1);
+}
+
+static void row_long(const char *key, long val) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%ld", val);
+    row_add(key, buf, 0);
+}
+
+static void row_double(const char *key, double val) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", val);
+    row_add(key, buf, 0);
+}
+
+static void row_end(void) {
+    if (opt.format == FORMAT_CSV) {
+        if (!header_done)
+            printf("%s\n", row_keys);
+        printf("%s\n", row_vals);
+    } else {
+        printf("{%s}\n", row_vals);
+    }
+    header_done = 1;
+    row_keys[0] = row_vals[0] = '\0';
+    fflush(stdout);
+}
+
+/* Counter per operation, NA (null in JSON) if it isn't available. */
+static void row_perf(const char *key, double val, int valid) {
+    char buf[32];
+
+    if (valid)
+        snprintf(buf, sizeof(buf), "%.4g", val);
+    else
+        snprintf(buf, sizeof(buf), "%s", opt.format == FORMAT_CSV ? "NA" : "null");
+    row_add(key, buf, 0);
+}
+
+static void row_perf_values(const struct perf_values *p, long ops) {
+    char key[64];
+    double n = ops > 0 ? ops : 1;
+
+    for (int e = 0; e < PERF_NEV; e++) {
+        snprintf(key, sizeof(key), "%s_per_op",
+                 e == PERF_EV_TASK_CLOCK ? "cpu_ns" : perf_ev_names[e]);
+        row_perf(key, p->v[e] / n, p->valid[e]);
+    }
+    row_perf("ipc", p->v[PERF_EV_CYCLES] ?
+             (double)p->v[PERF_EV_INSTRUCTIONS] / p->v[PERF_EV_CYCLES] : 0,
+             p->valid[PERF_EV_CYCLES] && p->valid[PERF_EV_INSTRUCTIONS]);
+}
+
+static void row_hist(const char *prefix, const struct hist *h) {
+    static const struct {
+        const char *name;
+        double q;
+    } pct[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 },
+    };
+    char key[64];
+
+    for (unsigned i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+        snprintf(key, sizeof(key), "%s_%s_ns", prefix, pct[i].name);
+        row_double(key, hist_quantile(h, pct[i].q) / tsc_per_ns);
+    }
+    snprintf(key, sizeof(key), "%s_max_ns", prefix);
+    row_double(key, h->max / tsc_per_ns);
+}
+
+static void print_row(const struct bench_lock *l, int n,
+        const struct bench_work *work, struct result *res) {
+    row_str("lock", l->name);
+    if (opt.nphases)
+        row_long("phase", res->phase);
+    row_long("threads", n);
+    row_long("cs_lines", work->cs_lines);
+    row_str("cs_data", work->cs_shared ? "shared" : "local");
+    row_str("cs_access", work->cs_write ? "write" : "read");
+    row_long("think_ns", tsc_per_ns > 0 ? lround(work->think / tsc_per_ns) : 0);
+    row_str("think_dist", work->think_random ? "random" : "fixed");
+    row_long("read_pct", work->read_pct);
+    row_str("placement", opt.placement_name);
+    if (opt.timeout_set) {
+        row_long("timeout_ns", opt.timeout_ns);
+        row_long("timeout_pct", work->timeout_pct);
+    }
+    if (opt.backoff_set) {
+        row_str("backoff", backoff_names[cur_backoff.kind]);
+        row_long("backoff_min_ns", cur_backoff.min_ns);
+        row_long("backoff_max_ns", cur_backoff.max_ns);
+    }
+    row_long("ops", res->ops);
+    row_double("ns_per_op", res->sec * 1e9 / res->ops);
+    row_double("mops_per_s", res->ops / res->sec / 1e6);
+    if (opt.perf)
+        row_perf_values(&res->perf, res->ops);
+    if (opt.timeout_set) {
+        row_long("timeouts", res->timeouts);
+        row_double("timeout_rate", res->ops + res->timeouts ?
+                   (double)res->timeouts / (res->ops + res->timeouts) : 0);
+    }
+    /* Fairness is over the whole run, not reported for phases. */
+    if (opt.duration > 0 && !opt.nphases) {
+        row_long("acq_min", res->acq_min);
+        row_long("acq_max", res->acq_max);
+        row_double("acq_stddev", res->acq_stddev);
+        row_double("jain", res->jain);
+        row_long("max_streak", res->max_streak);
+        row_double("max_wait_ns", res->max_wait / tsc_per_ns);
+    }
+    if (opt.latency) {
+        row_hist("acquire", res->acquire);
+        row_hist("hold", res->hold);
+        hist_free(res->acquire);
+        hist_free(res->hold);
+    }
+    if (opt.lock_stats) {
+        char buf[256] = "";
+
+        if (l->stats)
+            l->stats(NULL, buf, sizeof(buf));
+        row_str("lock_stats", buf);
+    }
+    row_end();
+}
+
+static void parse_locks(char *arg) {
+    char *save, *name;
+
+    opt.nlocks = 0;
+    for (name = strtok_r(arg, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        if (strcmp(name, "all") == 0) {
+            for (int i = 0; i < bench_nlocks; i++)
+                opt.locks[opt.nlocks++] = bench_locks[i];
+            continue;
+        }
+        const struct bench_lock *l = bench_find_lock(name);
+        if (!l) {
+            fprintf(stderr, "unknown lock: %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+        if (opt.nlocks < BENCH_MAX_LOCKS)
+            opt.locks[opt.nlocks++] = l;
+    }
+}
+
+/* Parse a comma separated list of integers no smaller than min. */
+static void parse_list(char *arg, int *list, int *n, int min, const char *what) {
+    char *save, *s;
+
+    *n = 0;
+    for (s = strtok_r(arg, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+        int v = atoi(s);
+        if (v < min || *n == MAX_SWEEP) {
+            fprintf(stderr, "invalid %s: %s\n", what, s);
+            exit(EXIT_FAILURE);
+        }
+        list[(*n)++] = v;
+    }
+}
+
+/* Thread counts may be given relative to the online CPUs, "2x" means two
+ * threads per CPU. Used to test oversubscription. */
+static void parse_threads(char *arg, int *list, int *n) {
+    char *save, *s;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    *n = 0;
+    for (s = strtok_r(arg, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+        char *end;
+        long v = strtol(s, &end, 10);
+
+        if (*end == 'x' && end[1] == '\0')
+            v *= ncpu;
+        else if (*end)
+            v = 0;
+        if (v < 1 || *n == MAX_SWEEP) {
+            fprintf(stderr, "invalid thread count: %s\n", s);
+            exit(EXIT_FAILURE);
+        }
+        list[(*n)++] = v;
+    }
+}
+
+/* Pick one of two values by name, used for the workload options. */
+static int parse_choice(const char *arg, const char *zero, const char *one) {
+    if (strcmp(arg, zero) == 0)
+        return 0;
+    if (strcmp(arg, one) == 0)
+        return 1;
+    fprintf(stderr, "expect %s or %s: %s\n", zero, one, arg);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_placement(char *arg) {
+    static const struct {
+        const char *name;
+        enum placement p;
+    } policies[] = {
+        { "none", PLACE_NONE },
+        { "compact", PLACE_COMPACT },
+        { "core", PLACE_CORE },
+        { "socket", PLACE_SOCKET },
+    };
+
+    opt.placement_name = strdup(arg);
+    for (unsigned i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(arg, policies[i].name) == 0) {
+            opt.placement = policies[i].p;
+            return;
+        }
+    }
+    opt.placement = PLACE_LIST;
+    opt.cpu_list = calloc(CPU_SETSIZE, sizeof(int));
+    opt.ncpu_list = parse_cpulist(arg, opt.cpu_list, CPU_SETSIZE);
+    if (opt.ncpu_list <= 0) {
+        fprintf(stderr, "invalid placement: %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void parse_backoff(char *arg) {
+    char *save, *s;
+
+    opt.nbackoff = 0;
+    opt.backoff_set = 1;
+    for (s = strtok_r(arg, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+        int kind = backoff_parse(s);
+        if (kind < 0 || opt.nbackoff == MAX_SWEEP) {
+            fprintf(stderr, "invalid backoff: %s\n", s);
+            exit(EXIT_FAILURE);
+        }
+        opt.backoff[opt.nbackoff++] = kind;
+    }
+}
+
+static void setup_placement(void) {
+    if (opt.placement == PLACE_NONE)
+        return;
+    if (opt.placement == PLACE_LIST) {
+        place_order = opt.cpu_list;
+        nplace_order = opt.ncpu_list;
+        return;
+    }
+    place_order = calloc(topo.ncpu, sizeof(int));
+    nplace_order = topology_order(&topo, opt.placement, place_order);
+}
+
+/* One row for each phase of a phased run. */
+static void print_phases(const struct bench_lock *l,
+        const struct bench_work *work, struct result *res) {
+    for (int p = 0; p < opt.nphases; p++) {
+        res->phase = p;
+        res->ops = res->phase_ops[p];
+        res->sec = res->phase_sec[p];
+        print_row(l, opt.phases[p], work, res);
+    }
+}
+
+/* Run one workload with every backoff policy. Only the first min and max are
+ * used without backoff since they don't change anything. */
+static void run_backoff(const struct bench_lock *l, int n,
+        const struct bench_work *work) {
+    const struct bench_lock *run;
+
+    for (int b = 0; b < opt.nbackoff; b++) {
+        for (int lo = 0; lo < opt.nbackoff_min; lo++) {
+            for (int hi = 0; hi < opt.nbackoff_max; hi++) {
+                if (opt.backoff[b] == BACKOFF_NONE && (lo || hi))
+                    continue;
+                if (opt.backoff_max[hi] < opt.backoff_min[lo])
+                    continue;
+                cur_backoff.kind = opt.backoff[b];
+                cur_backoff.min_ns = opt.backoff_min[lo];
+                cur_backoff.max_ns = opt.backoff_max[hi];
+                backoff_configure(cur_backoff.kind, cur_backoff.min_ns,
+                                  cur_backoff.max_ns, tsc_per_ns);
+                /* Without a policy the plain object runs, spinning with each
+                 * lock's own pause loop. */
+                if (cur_backoff.kind != BACKOFF_NONE && l->backoff)
+                    run = l->backoff;
+                else
+                    run = l;
+                for (int r = 0; r < opt.repeat; r++) {
+                    struct result res = { 0 };
+                    run_once(run, n, work, &res);
+                    if (opt.nphases)
+                        print_phases(run, work, &res);
+                    else
+                        print_row(run, n, work, &res);
+                }
+            }
+        }
+    }
+}
+
+/* Run every thread count, critical section length, think time, read
+ * percentage, timeout percentage and backoff policy for one lock. Together the rows give a
+ * throughput surface. */
+static void run_sweep(const struct bench_lock *l) {
+    struct bench_work work = {
+        .cs_shared = opt.cs_shared,
+        .cs_write = opt.cs_write,
+        .think_random = opt.think_random,
+        .timeout = opt.timeout_ns,
+    };
+
+    if (opt.timeout_set && !l->timeout) {
+        fprintf(stderr, "skip %s: no acquire with timeout\n", l->name);
+        return;
+    }
+    /* A phased run starts the threads of the largest phase once. */
+    for (int i = 0; i < (opt.nphases ? 1 : opt.nthreads); i++) {
+        int n = opt.nphases ? opt.phase_max : opt.threads[i];
+
+        if (l->max_threads && n > l->max_threads) {
+            fprintf(stderr, "skip %s with %d threads: supports at most %d\n",
+                    l->name, n, l->max_threads);
+            continue;
+        }
+        for (int c = 0; c < opt.ncs_lines; c++) {
+            for (int k = 0; k < opt.nthink_ns; k++) {
+                for (int p = 0; p < opt.nread_pct; p++) {
+                    for (int o = 0; o < opt.ntimeout_pct; o++) {
+                        work.cs_lines = opt.cs_lines[c];
+                        work.think = opt.think_ns[k] * tsc_per_ns;
+                        work.read_pct = opt.read_pct[p];
+                        work.timeout_pct = opt.timeout_pct[o];
+                        run_backoff(l, n, &work);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options]\n"
+           "  --lock=NAME[,NAME...]  locks to run, or \"all\" (default all)\n"
+           "  --threads=N[,N...]     thread counts to sweep (default 1), Nx means N\n"
+           "                         threads per online CPU\n"
+           "  --ops=N                total lock/unlock pairs per run (default %d)\n"
+           "  --repeat=N             runs for each lock and thread count (default 1)\n"
+           "  --format=csv|json      output format (default csv)\n"
+           "  --duration=SEC         run each test for SEC seconds instead of a fixed\n"
+           "                         number of ops and report per thread fairness\n"
+           "  --timeout-pct=P[,P...] percentage of exclusive acquisitions giving up\n"
+           "                         after --timeout ns, needs --duration; ops\n"
+           "                         counts successful acquisitions only\n"
+           "  --timeout=NS           timeout of timed acquisitions (default %d)\n"
+           "  --phases=N[,N...]      one run changing the thread count every\n"
+           "                         duration, one row per phase; replaces --threads\n"
+           "  --cs-lines=N[,N...]    cache lines touched in the critical section\n"
+           "                         (default 1)\n"
+           "  --cs-data=local|shared touch thread local or shared data (default local)\n"
+           "  --cs-access=write|read write or only read the data (default write)\n"
+           "  --think=NS[,NS...]     busy work between release and next acquire\n"
+           "                         (default 0)\n"
+           "  --think-dist=fixed|random\n"
+           "                         fixed think time or uniform in [0, 2*NS]\n"
+           "  --read-pct=P[,P...]    percentage of operations taking reader-writer\n"
+           "                         locks for read, exclusive locks ignore it\n"
+           "                         (default 0)\n"
+           "  --placement=POLICY     thread placement: none, compact (fill SMT\n"
+           "                         siblings first), core (one thread per physical\n"
+           "                         core), socket (round robin over sockets) or a\n"
+           "                         CPU list like 0,2,4-7 (default none)\n"
+           "  --backoff=KIND[,KIND...]\n"
+           "                         backoff policy of the spin loops: none, exp,\n"
+           "                         jitter or prop (default none), see backoff.h;\n"
+           "                         xchg-backoff and ticket-backoff keep their own\n"
+           "  --backoff-min=NS[,NS...]\n"
+           "                         first wait, or wait per queued thread for prop\n"
+           "                         (default %d)\n"
+           "  --backoff-max=NS[,NS...]\n"
+           "                         upper bound of a single wait (default %d)\n"
+           "  --topology             print detected CPU topology and exit\n"
+           "  --latency              record per operation acquire and hold time\n"
+           "                         and report percentiles\n"
+           "  --perf                 count cycles, instructions, cache misses, HITM\n"
+           "                         loads, context switches and migrations per\n"
+           "                         thread with perf_event_open and report them\n"
+           "                         per operation; only software events in VMs\n"
+           "                         without a PMU\n"
+           "  --perf-hitm=CONFIG     raw event config counted as HITM, e.g. 0x04d2\n"
+           "                         (default picked by CPU, Intel only)\n"
+           "  --list                 list available locks\n",
+           prog, N_PAIR, TIMEOUT_NS, BACKOFF_MIN_NS, BACKOFF_MAX_NS);
+    printf("Locks:");
+    for (int i = 0; i < bench_nlocks; i++)
+        printf(" %s", bench_locks[i]->name);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_opts[] = {
+        { "lock",    required_argument, NULL, 'l' },
+        { "threads", required_argument, NULL, 't' },
+        { "ops",     required_argument, NULL, 'n' },
+        { "repeat",  required_argument, NULL, 'r' },
+        { "format",  required_argument, NULL, 'f' },
+        { "latency", no_argument,       NULL, 'H' },
+        { "perf",    no_argument,       NULL, 'e' },
+        { "perf-hitm", required_argument, NULL, 'E' },
+        { "duration", required_argument, NULL, 'd' },
+        { "cs-lines", required_argument, NULL, 'c' },
+        { "cs-data", required_argument, NULL, 'D' },
+        { "cs-access", required_argument, NULL, 'A' },
+        { "think",   required_argument, NULL, 'k' },
+        { "think-dist", required_argument, NULL, 'K' },
+        { "read-pct", required_argument, NULL, 'R' },
+        { "placement", required_argument, NULL, 'p' },
+        { "phases",  required_argument, NULL, 'P' },
+        { "timeout", required_argument, NULL, 'o' },
+        { "timeout-pct", required_argument, NULL, 'O' },
+        { "backoff", required_argument, NULL, 'b' },
+        { "backoff-min", required_argument, NULL, 'm' },
+        { "backoff-max", required_argument, NULL, 'M' },
+        { "topology", no_argument,       NULL, 'T' },
+        { "list",    no_argument,       NULL, 'L' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+
+    opt.ops = N_PAIR;
+    opt.repeat = 1;
+    opt.format = FORMAT_CSV;
+    opt.cs_write = 1;
+    opt.placement_name = "none";
+
+    /* With LOCKSTAT, SIGUSR1 prints the lock report. */
+    lockstat_report_on_signal(SIGUSR1);
+
+    while ((c = getopt_long(argc, argv, "l:t:n:r:f:HeE:d:c:D:A:k:K:R:p:P:o:O:b:m:M:TLh", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'l':
+            parse_locks(optarg);
+            break;
+        case 't':
+            parse_threads(optarg, opt.threads, &opt.nthreads);
+            break;
+        case 'n':
+            opt.ops = atol(optarg);
+            break;
+        case 'r':
+            opt.repeat = atoi(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) {
+                opt.format = FORMAT_CSV;
+            } else if (strcmp(optarg, "json") == 0) {
+                opt.format = FORMAT_JSON;
+            } else {
+                fprintf(stderr, "unknown format: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'H':
+            opt.latency = 1;
+            break;
+        case 'e':
+            opt.perf = 1;
+            break;
+        case 'E':
+            opt.perf = 1;
+            opt.perf_hitm = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            opt.duration = atof(optarg);
+            break;
+        case 'c':
+            parse_list(optarg, opt.cs_lines, &opt.ncs_lines, 1, "cs lines");
+            break;
+        case 'D':
+            opt.cs_shared = parse_choice(optarg, "local", "shared");
+            break;
+        case 'A':
+            opt.cs_write = !parse_choice(optarg, "write", "read");
+            break;
+        case 'k':
+            parse_list(optarg, opt.think_ns, &opt.nthink_ns, 0, "think time");
+            break;
+        case 'K':
+            opt.think_random = parse_choice(optarg, "fixed", "random");
+            break;
+        case 'R':
+            parse_list(optarg, opt.read_pct, &opt.nread_pct, 0, "read percentage");
+            for (int i = 0; i < opt.nread_pct; i++) {
+                if (opt.read_pct[i] > 100) {
+                    fprintf(stderr, "read percentage above 100\n");
+                    return 1;
+                }
+            }
+            break;
+        case 'p':
+            parse_placement(optarg);
+            break;
+        case 'P':
+            parse_threads(optarg, opt.phases, &opt.nphases);
+            break;
+        case 'o':
+            opt.timeout_ns = atol(optarg);
+            break;
+        case 'O':
+            parse_list(optarg, opt.timeout_pct, &opt.ntimeout_pct, 0, "timeout percentage");
+            for (int i = 0; i < opt.ntimeout_pct; i++) {
+                if (opt.timeout_pct[i] > 100) {
+                    fprintf(stderr, "timeout percentage above 100\n");
+                    return 1;
+                }
+            }
+            opt.timeout_set = 1;
+            break;
+        case 'b':
+            parse_backoff(optarg);
+            break;
+        case 'm':
+            parse_list(optarg, opt.backoff_min, &opt.nbackoff_min, 0, "backoff min");
+            break;
+        case 'M':
+            parse_list(optarg, opt.backoff_max, &opt.nbackoff_max, 0, "backoff max");
+            break;
+        case 'T':
+            topology_load(&topo);
+            topology_print(&topo);
+            return 0;
+        case 'L':
+            for (int i = 0; i < bench_nlocks; i++)
+                printf("%s\n", bench_locks[i]->name);
+            return 0;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.ops <= 0 || opt.repeat <= 0) {
+        fprintf(stderr, "--ops and --repeat must be positive\n");
+        return 1;
+    }
+    if (opt.timeout_set && opt.duration <= 0) {
+        fprintf(stderr, "--timeout-pct needs --duration\n");
+        return 1;
+    }
+    if (opt.nphases && (opt.duration <= 0 || opt.latency)) {
+        fprintf(stderr, "--phases needs --duration and can't be used with --latency\n");
+        return 1;
+    }
+    if (opt.nphases && opt.perf) {
+        fprintf(stderr, "--phases can't be used with --perf\n");
+        return 1;
+    }
+    for (int i = 0; i < opt.nphases; i++) {
+        if (opt.phases[i] > opt.phase_max)
+            opt.phase_max = opt.phases[i];
+    }
+    if (opt.nlocks == 0) {
+        for (int i = 0; i < bench_nlocks; i++)
+            opt.locks[opt.nlocks++] = bench_locks[i];
+    }
+    for (int i = 0; i < opt.nlocks; i++) {
+        if (opt.locks[i]->stats)
+            opt.lock_stats = 1;
+    }
+    if (opt.nthreads == 0)
+        opt.threads[opt.nthreads++] = 1;
+    if (opt.ncs_lines == 0)
+        opt.cs_lines[opt.ncs_lines++] = 1;
+    if (opt.nthink_ns == 0)
+        opt.think_ns[opt.nthink_ns++] = 0;
+    if (opt.nread_pct == 0)
+        opt.read_pct[opt.nread_pct++] = 0;
+    if (opt.ntimeout_pct == 0)
+        opt.timeout_pct[opt.ntimeout_pct++] = 0;
+    if (opt.timeout_ns <= 0)
+        opt.timeout_ns = TIMEOUT_NS;
+    if (opt.nbackoff == 0)
+        opt.backoff[opt.nbackoff++] = BACKOFF_NONE;
+    if (opt.nbackoff_min == 0)
+        opt.backoff_min[opt.nbackoff_min++] = BACKOFF_MIN_NS;
+    if (opt.nbackoff_max == 0)
+        opt.backoff_max[opt.nbackoff_max++] = BACKOFF_MAX_NS;
+
+    topology_load(&topo);
+    setup_placement();
+    tsc_per_ns = tsc_calibrate();
+    if (opt.perf)
+        perf_setup(opt.perf_hitm);
+
+    for (int i = 0; i < opt.nlocks; i++) {
+        const struct bench_lock *l = opt.locks[i];
+
+        if (l->supported && !l->supported()) {
+            fprintf(stderr, "skip %s: not supported on this CPU\n", l->name);
+            continue;
+        }
+        run_sweep(l);
+    }
+
+    return 0;
+}
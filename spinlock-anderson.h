@@ -0,0 +1,69 @@
+#ifndef _SPINLOCK_ANDERSON_H
+#define _SPINLOCK_ANDERSON_H
+
+/* Anderson array based queue lock.
+ *
+ * Like the ticket lock, a thread takes a ticket with xadd, but it then spins
+ * on its own cache line slot[ticket % ANDERSON_SLOTS] instead of the shared
+ * ticket word. Unlock only writes the slot of the next waiter, so a handoff
+ * invalidates one waiter's line instead of all of them.
+ *
+ * At most ANDERSON_SLOTS threads may use a lock at the same time, more would
+ * share a slot and break mutual exclusion. ANDERSON_SLOTS must be a power of
+ * two so the 32 bit ticket wraps around consistently. The lock must be set up
+ * with anderson_init. */
+
+#define atomic_xadd(P, V) __sync_fetch_and_add((P), (V))
+
+#define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+#ifndef ANDERSON_SLOTS
+#define ANDERSON_SLOTS 256
+#endif
+
+typedef struct anderson_slot anderson_slot;
+struct anderson_slot
+{
+    volatile int has_lock;
+} __attribute__((aligned(64)));
+
+typedef struct andersonlock andersonlock;
+struct andersonlock
+{
+    unsigned next __attribute__((aligned(64)));
+    /* Slot of the lock owner, only used by the owner. On its own line so
+     * arriving threads' xadd on next doesn't steal it during the handoff. */
+    unsigned holder __attribute__((aligned(64)));
+    anderson_slot slot[ANDERSON_SLOTS];
+};
+
+static inline void anderson_init(andersonlock *l)
+{
+    l->next = 0;
+    l->holder = 0;
+    for (int i = 0; i < ANDERSON_SLOTS; i++)
+        l->slot[i].has_lock = 0;
+    l->slot[0].has_lock = 1;
+}
+
+static inline void anderson_lock(andersonlock *l)
+{
+    unsigned me = atomic_xadd(&l->next, 1) % ANDERSON_SLOTS;
+
+    while (!l->slot[me].has_lock) cpu_relax();
+
+    /* Reset for the thread using this slot ANDERSON_SLOTS tickets later. */
+    l->slot[me].has_lock = 0;
+    l->holder = me;
+}
+
+static inline void anderson_unlock(andersonlock *l)
+{
+    barrier();
+    l->slot[(l->holder + 1) % ANDERSON_SLOTS].has_lock = 1;
+}
+
+#endif /* _SPINLOCK_ANDERSON_H */
@@ -0,0 +1,200 @@
+#ifndef _SPINLOCK_CLH_TIMEOUT
+#define _SPINLOCK_CLH_TIMEOUT
+
+/* CLH queue lock with timeout, after the TOLock in "The Art of Multiprocessor
+ * Programming" by Herlihy and Shavit, based on Scott's CLH-try.
+ *
+ * A node's pred field says what its successor should do: NULL means keep
+ * waiting, CLHTO_AVAILABLE means the lock was released, and any other value
+ * means the owner gave up and the successor should wait on that node instead.
+ * A waiter leaving the queue thus never unlinks itself, it leaves a pointer
+ * past itself behind. If it is the last in the queue it moves the tail back to
+ * its predecessor, then nobody ever sees its node.
+ *
+ * Every node has a single owner at any time. The successor which reads
+ * CLHTO_AVAILABLE or a forwarding pointer from a node owns it from then on and
+ * puts it in its per thread node cache, so no node is passed to the lock
+ * functions. A released node stays in the queue until the next acquisition,
+ * which makes release a plain store as in CLH.
+ *
+ * A lock filled with zero is unlocked. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "tsc.h"
+
+#define cmpxchg(P, O, N) __sync_val_compare_and_swap((P), (O), (N))
+
+#define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+typedef struct clhto_node clhto_node;
+
+#define CLHTO_AVAILABLE ((clhto_node *)1)
+
+struct clhto_node
+{
+    clhto_node *volatile pred;
+    clhto_node *free_next; /* In the owner's node cache. */
+} __attribute__((aligned(64)));
+
+typedef struct clhtolock clhtolock;
+struct clhtolock
+{
+    clhto_node *volatile tail;
+    clhto_node *holder; /* Only accessed by the lock holder. */
+};
+
+static __thread clhto_node *clhto_cache;
+static pthread_key_t clhto_key;
+static pthread_once_t clhto_once = PTHREAD_ONCE_INIT;
+
+/* Thread locals are still there when key destructors run. */
+static void clhto_thread_exit(void *unused)
+{
+    while (clhto_cache) {
+        clhto_node *n = clhto_cache;
+
+        clhto_cache = n->free_next;
+        free(n);
+    }
+}
+
+static void clhto_key_init(void)
+{
+    if (pthread_key_create(&clhto_key, clhto_thread_exit) != 0)
+        abort();
+}
+
+static inline void clhto_put(clhto_node *n)
+{
+    n->free_next = clhto_cache;
+    clhto_cache = n;
+}
+
+static clhto_node *clhto_alloc(void)
+{
+    clhto_node *n;
+
+    pthread_once(&clhto_once, clhto_key_init);
+    if (posix_memalign((void **)&n, 64, sizeof(*n)) != 0)
+        abort();
+    /* Any non NULL value makes the destructor run. */
+    if (!pthread_getspecific(clhto_key))
+        pthread_setspecific(clhto_key, (void *)1);
+    return n;
+}
+
+/* TSC ticks per ns for the timed wait, calibrated once before the first
+ * timed acquire so the wait loop only reads the TSC. */
+static double clhto_tsc_per_ns;
+static pthread_once_t clhto_tsc_once = PTHREAD_ONCE_INIT;
+
+static void clhto_tsc_init(void)
+{
+    clhto_tsc_per_ns = tsc_calibrate();
+}
+
+/* Calibration takes about 50ms, call before timing to keep it out of the
+ * first timed acquire. */
+static inline void clhto_setup(void)
+{
+    pthread_once(&clhto_tsc_once, clhto_tsc_init);
+}
+
+static inline clhto_node *clhto_get(void)
+{
+    clhto_node *n = clhto_cache;
+
+    if (!n) return clhto_alloc();
+    clhto_cache = n->free_next;
+    return n;
+}
+
+static inline void *clhto_xchg_64(void *ptr, void *x)
+{
+    __asm__ __volatile__("xchgq %0,%1"
+                :"=r" ((unsigned long long) x)
+                :"m" (*(volatile long long *)ptr), "0" ((unsigned long long) x)
+                :"memory");
+
+    return x;
+}
+
+/* Give up after ns nanoseconds if timed. Return 0 if the lock was taken. */
+static inline int clhto_acquire(clhtolock *l, uint64_t ns, int timed)
+{
+    clhto_node *me = clhto_get();
+    clhto_node *pred, *p;
+    uint64_t deadline = 0;
+
+    me->pred = NULL;
+    pred = clhto_xchg_64((void *)&l->tail, me);
+    if (!pred) goto acquired;
+
+    while (1) {
+        p = pred->pred;
+        if (p == CLHTO_AVAILABLE) {
+            clhto_put(pred);
+            goto acquired;
+        }
+        if (p) {
+            /* Predecessor left, its node is ours now. */
+            clhto_put(pred);
+            pred = p;
+            continue;
+        }
+        if (timed) {
+            uint64_t now = rdtsc();
+
+            if (!deadline)
+                deadline = now + (uint64_t)(ns * clhto_tsc_per_ns);
+            if (now >= deadline)
+                break;
+        }
+        cpu_relax();
+    }
+
+    /* Timed out. Last in the queue: nobody saw our node. Otherwise let the
+     * successor skip to pred, it also takes over our node. */
+    if (cmpxchg(&l->tail, me, pred) == me)
+        clhto_put(me);
+    else
+        me->pred = pred;
+    return 1;
+
+acquired:
+    l->holder = me;
+    return 0;
+}
+
+static inline void clhto_lock(clhtolock *l)
+{
+    clhto_acquire(l, 0, 0);
+}
+
+/* Return 0 if the lock was taken within ns nanoseconds. */
+static inline int clhto_lock_timeout(clhtolock *l, uint64_t ns)
+{
+    clhto_setup();
+    return clhto_acquire(l, ns, 1);
+}
+
+static inline void clhto_unlock(clhtolock *l)
+{
+    clhto_node *me = l->holder;
+
+    barrier();
+    me->pred = CLHTO_AVAILABLE;
+}
+
+/* Queues and gives up right away unless the lock is free. */
+static inline int clhto_trylock(clhtolock *l)
+{
+    return clhto_acquire(l, 0, 1);
+}
+
+#endif
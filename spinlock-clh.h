@@ -0,0 +1,83 @@
+#ifndef _SPINLOCK_CLH
+#define _SPINLOCK_CLH
+
+/* CLH queue lock by Craig, Landin and Hagersten.
+ *
+ * Every waiter spins on the node of its predecessor. Acquire is a single xchg
+ * on the tail and release is a plain store, there is no cmpxchg in unlock as
+ * in MCS.
+ *
+ * Nodes are recycled: after unlock the node passed in is still watched by the
+ * successor, so the thread takes over its predecessor's node, which nobody
+ * references anymore. The caller keeps a clh_node pointer which changes on
+ * every unlock. Nodes therefore move between threads and must not be freed
+ * (or live on a stack) while any thread may still use the lock.
+ *
+ * A lock filled with zero is unlocked. The first acquirer finds a NULL tail
+ * and uses the dummy node embedded in the lock as its predecessor.
+ *
+ * There is no trylock: a recycled node can be the tail and be locked again
+ * between checking it and swapping the tail, so joining the queue could wait.
+ *
+ * Define CLH_PADDED before including to put each node on its own cache line.
+ * Without padding, nodes allocated next to each other share a line and a
+ * release also invalidates the line of an unrelated waiter. */
+
+#include <stddef.h>
+
+#define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+typedef struct clh_node clh_node;
+struct clh_node
+{
+    volatile int locked;
+    clh_node *pred; /* Only used by the owner of this node. */
+#ifdef CLH_PADDED
+} __attribute__((aligned(64)));
+#else
+};
+#endif
+
+typedef struct clhlock clhlock;
+struct clhlock
+{
+    clh_node *tail;
+    clh_node dummy;
+};
+
+static inline void *clh_xchg_64(void *ptr, void *x)
+{
+    __asm__ __volatile__("xchgq %0,%1"
+                :"=r" ((unsigned long long) x)
+                :"m" (*(volatile long long *)ptr), "0" ((unsigned long long) x)
+                :"memory");
+
+    return x;
+}
+
+static inline void clh_lock(clhlock *l, clh_node **node)
+{
+    clh_node *me = *node;
+    clh_node *pred;
+
+    me->locked = 1;
+    pred = clh_xchg_64(&l->tail, me);
+    if (!pred) pred = &l->dummy;
+    me->pred = pred;
+
+    while (pred->locked) cpu_relax();
+}
+
+static inline void clh_unlock(clhlock *l, clh_node **node)
+{
+    clh_node *me = *node;
+
+    *node = me->pred;
+    barrier();
+    me->locked = 0;
+}
+
+#endif
@@ -8,7 +8,9 @@ typedef struct {
 #define SPINLOCK_ATTR static __inline __attribute__((always_inline, no_instrument_function))
 
 /* Pause instruction to prevent excess processor bus usage */
+#ifndef cpu_relax
 #define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
 
 SPINLOCK_ATTR char __testandset(spinlock *p)
 {
@@ -0,0 +1,129 @@
+#ifndef _SPINLOCK_COHORT
+#define _SPINLOCK_COHORT
+
+/* NUMA aware cohort lock (C-TKT-MCS) from "Lock Cohorting: A General Technique
+ * for Designing NUMA Locks" by Dice, Marathe and Shavit.
+ *
+ * Each NUMA node has a local MCS lock, and the node currently holding the lock
+ * also holds a global ticket lock. On unlock, if another thread of the same
+ * node is queued on the local lock, the global lock is passed along with the
+ * local lock and stays on this node. This keeps the lock and the protected data
+ * in one socket's caches. After COHORT_MAX_HANDOFF local handoffs the global
+ * lock is released to avoid starving other nodes.
+ *
+ * Both component locks are thread oblivious (any thread may release them),
+ * and MCS can tell whether it has a waiter, as the algorithm requires.
+ *
+ * Nodes are taken from the topology read from sysfs (topology.h), link
+ * topology.o. Set COHORT_NODES=N in the
+ * environment to split the online CPUs into N simulated nodes of consecutive
+ * CPUs, which is useful on single socket machines. */
+
+/* sched_getcpu needs _GNU_SOURCE defined before the first include. */
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "spinlock-mcs.h"
+#include "spinlock-ticket.h"
+#include "topology.h"
+
+#ifndef COHORT_MAX_HANDOFF
+#define COHORT_MAX_HANDOFF 64
+#endif
+
+#define COHORT_MAX_NODES 64
+#define COHORT_MAX_CPUS 4096
+
+typedef struct cohort_local cohort_local;
+struct cohort_local
+{
+    mcs_lock lock;
+    /* Only accessed by the holder of lock. */
+    int global_owned; /* Global lock was passed from the previous holder. */
+    int handoffs;     /* Consecutive local handoffs. */
+} __attribute__((aligned(64)));
+
+/* All zero is unlocked. */
+typedef struct cohortlock cohortlock;
+struct cohortlock
+{
+    ticketlock global __attribute__((aligned(64)));
+    cohort_local local[COHORT_MAX_NODES];
+};
+
+static int cohort_cpu_node[COHORT_MAX_CPUS];
+static pthread_once_t cohort_once = PTHREAD_ONCE_INIT;
+static __thread int cohort_my_node = -1;
+
+static void cohort_topology_init(void)
+{
+    const char *sim = getenv("COHORT_NODES");
+    struct topology topo;
+
+    if (sim && atoi(sim) > 0) {
+        int nsim = atoi(sim);
+        int ncpu = sysconf(_SC_NPROCESSORS_CONF);
+        int per = (ncpu + nsim - 1) / nsim;
+
+        if (per <= 0) per = 1;
+        for (int c = 0; c < COHORT_MAX_CPUS; c++)
+            cohort_cpu_node[c] = (c / per) % nsim % COHORT_MAX_NODES;
+        return;
+    }
+
+    topology_load(&topo);
+    for (int i = 0; i < topo.ncpu; i++) {
+        const struct cpu_info *c = &topo.cpu[i];
+
+        if (c->cpu < COHORT_MAX_CPUS)
+            cohort_cpu_node[c->cpu] = c->node % COHORT_MAX_NODES;
+    }
+    topology_free(&topo);
+}
+
+/* Node of the calling thread, looked up once. A thread migrating to another
+ * node keeps using its old local lock, which is still correct. */
+static inline int cohort_node(void)
+{
+    if (cohort_my_node < 0) {
+        int cpu;
+
+        pthread_once(&cohort_once, cohort_topology_init);
+        cpu = sched_getcpu();
+        cohort_my_node = (cpu >= 0 && cpu < COHORT_MAX_CPUS) ? cohort_cpu_node[cpu] : 0;
+    }
+    return cohort_my_node;
+}
+
+static inline void cohort_lock(cohortlock *c, mcs_lock_t *me)
+{
+    cohort_local *l = &c->local[cohort_node()];
+
+    lock_mcs(&l->lock, me);
+
+    /* Predecessor in our cohort left the global lock to us. */
+    if (l->global_owned) return;
+
+    ticket_lock(&c->global);
+    l->global_owned = 1;
+    l->handoffs = 0;
+}
+
+static inline void cohort_unlock(cohortlock *c, mcs_lock_t *me)
+{
+    cohort_local *l = &c->local[cohort_node()];
+
+    /* A waiter on the local lock, keep the global lock in this node. */
+    if (me->next && l->handoffs < COHORT_MAX_HANDOFF) {
+        l->handoffs++;
+        unlock_mcs(&l->lock, me);
+        return;
+    }
+
+    l->global_owned = 0;
+    ticket_unlock(&c->global);
+    unlock_mcs(&l->lock, me);
+}
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef _SPINLOCK_FC
+#define _SPINLOCK_FC
+
+/* Flat combining lock, after "Flat Combining and the Synchronization-
+ * Parallelism Tradeoff" by Hendler, Incze, Shavit and Tzafrir.
+ *
+ * Instead of taking the lock and running the critical section itself, a
+ * thread publishes a function and its argument in its slot of the lock and
+ * waits. Whoever gets the lock becomes the combiner: it runs every published
+ * request, stores the results and clears the slots, then releases the lock.
+ * The protected data stays in the combiner's cache for the whole batch
+ * instead of moving to every acquiring core, and each waiter spins on its own
+ * slot.
+ *
+ * fc_lock and fc_unlock use the combiner lock as a plain test-and-set lock,
+ * so code taking the lock directly excludes delegated requests and the other
+ * way round. A request must not delegate to the same lock again.
+ *
+ * Slots are indexed by a per thread number taken on the first request and
+ * given back when the thread exits. Threads finding all FC_MAX_THREADS slots
+ * taken run their requests under fc_lock themselves. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+#ifndef FC_MAX_THREADS
+#define FC_MAX_THREADS 128
+#endif
+
+/* Scans over the slots per combining session, stopping early after a scan
+ * which found nothing. */
+#ifndef FC_PASSES
+#define FC_PASSES 3
+#endif
+
+typedef void *(*fc_fn)(void *);
+
+typedef struct fc_slot fc_slot;
+struct fc_slot
+{
+    volatile fc_fn fn; /* Set while the request is pending. */
+    void *arg;
+    void *volatile ret;
+} __attribute__((aligned(64)));
+
+/* All zero is unlocked. */
+typedef struct fclock fclock;
+struct fclock
+{
+    volatile unsigned char locked;
+    /* Only accessed by the holder. */
+    unsigned long sessions;
+    unsigned long served;
+    fc_slot slot[FC_MAX_THREADS];
+};
+
+static volatile char fc_used[FC_MAX_THREADS];
+static volatile int fc_nslots; /* Highest slot ever taken plus one. */
+static pthread_key_t fc_key;
+static pthread_once_t fc_once = PTHREAD_ONCE_INIT;
+static __thread int fc_my = -1; /* -2 if no slot was free. */
+
+static void fc_thread_exit(void *slot)
+{
+    fc_used[(intptr_t)slot - 1] = 0;
+}
+
+static void fc_key_init(void)
+{
+    if (pthread_key_create(&fc_key, fc_thread_exit) != 0)
+        abort();
+}
+
+/* Return the slot of the calling thread, -1 if all are taken. */
+static int fc_register(void)
+{
+    pthread_once(&fc_once, fc_key_init);
+    for (int i = 0; i < FC_MAX_THREADS; i++) {
+        if (!fc_used[i] && __sync_bool_compare_and_swap(&fc_used[i], 0, 1)) {
+            int n;
+
+            while ((n = fc_nslots) <= i)
+                __sync_bool_compare_and_swap(&fc_nslots, n, i + 1);
+            pthread_setspecific(fc_key, (void *)(intptr_t)(i + 1));
+            fc_my = i;
+            return i;
+        }
+    }
+    fc_my = -2;
+    return -1;
+}
+
+static inline int fc_trylock(fclock *l)
+{
+    if (!l->locked && !__sync_lock_test_and_set(&l->locked, 1))
+        return 0;
+
+    return 1; // Busy
+}
+
+static inline void fc_lock(fclock *l)
+{
+    while (__sync_lock_test_and_set(&l->locked, 1))
+        while (l->locked) cpu_relax();
+}
+
+static inline void fc_unlock(fclock *l)
+{
+    __sync_lock_release(&l->locked);
+}
+
+/* Called with the lock held. */
+static inline void fc_combine(fclock *l)
+{
+    int n = fc_nslots;
+
+    l->sessions++;
+    for (int pass = 0; pass < FC_PASSES; pass++) {
+        unsigned long served = l->served;
+
+        for (int i = 0; i < n; i++) {
+            fc_slot *s = &l->slot[i];
+            fc_fn fn = s->fn;
+
+            if (!fn) continue;
+            s->ret = fn(s->arg);
+            barrier();
+            s->fn = NULL;
+            l->served++;
+        }
+        if (l->served == served)
+            break;
+    }
+}
+
+/* Run fn(arg) under the lock, possibly on another thread, and return its
+ * result. */
+static inline void *fc_execute(fclock *l, fc_fn fn, void *arg)
+{
+    int me = fc_my;
+    fc_slot *s;
+
+    if (me == -1) me = fc_register();
+    if (me < 0) {
+        void *ret;
+
+        fc_lock(l);
+        ret = fn(arg);
+        fc_unlock(l);
+        return ret;
+    }
+    s = &l->slot[me];
+    s->arg = arg;
+    barrier();
+    s->fn = fn;
+
+    while (s->fn) {
+        if (!fc_trylock(l)) {
+            fc_combine(l);
+            fc_unlock(l);
+        } else {
+            cpu_relax();
+        }
+    }
+    barrier();
+    return s->ret;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef _SPINLOCK_FUTEX_H
+#define _SPINLOCK_FUTEX_H
+
+/* Spin then park lock built on futex.
+ *
+ * The lock word has three states as in "Futexes Are Tricky" by Ulrich
+ * Drepper: 0 unlocked, 1 locked, 2 locked with possible waiters. Unlocking a
+ * lock nobody sleeps on is a single atomic decrement with no system call.
+ *
+ * Before sleeping a contender spins for a bounded number of iterations. Like
+ * glibc's PTHREAD_MUTEX_ADAPTIVE_NP the budget adapts: it is an average of
+ * the iterations recent acquisitions needed, so short critical sections keep
+ * spinning while long ones go to sleep quickly. Spinning forever is never
+ * done, which keeps this lock usable with more threads than cores. */
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define cmpxchg(P, O, N) __sync_val_compare_and_swap((P), (O), (N))
+
+#define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+/* Upper bound of the spin budget, in pause iterations. */
+#ifndef FUTEX_SPIN_MAX
+#define FUTEX_SPIN_MAX 1000
+#endif
+
+typedef struct futexlock futexlock;
+struct futexlock
+{
+    volatile int state;
+    int spins; /* Adaptive spin budget, updated without atomics. */
+};
+
+#define FUTEX_LOCK_INITIALIZER { 0, 0 }
+
+static inline void sys_futex(volatile int *addr, int op, int val)
+{
+    syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+static inline void futex_lock(futexlock *l)
+{
+    int c, cnt, max;
+
+    c = cmpxchg(&l->state, 0, 1);
+    if (!c) return;
+
+    max = l->spins * 2 + 10;
+    if (max > FUTEX_SPIN_MAX) max = FUTEX_SPIN_MAX;
+
+    for (cnt = 0; cnt < max; cnt++) {
+        cpu_relax();
+        if (!l->state && !(c = cmpxchg(&l->state, 0, 1))) {
+            l->spins += (cnt - l->spins) / 8;
+            return;
+        }
+    }
+    l->spins += (cnt - l->spins) / 8;
+
+    /* Mark the lock contended and sleep until it's released. */
+    if (c != 2) c = __sync_lock_test_and_set(&l->state, 2);
+    while (c) {
+        sys_futex(&l->state, FUTEX_WAIT_PRIVATE, 2);
+        c = __sync_lock_test_and_set(&l->state, 2);
+    }
+}
+
+static inline void futex_unlock(futexlock *l)
+{
+    /* 1 -> 0 needs no wake up. */
+    if (__sync_fetch_and_sub(&l->state, 1) != 1) {
+        l->state = 0;
+        sys_futex(&l->state, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+static inline int futex_trylock(futexlock *l)
+{
+    if (!cmpxchg(&l->state, 0, 1)) return 0;
+
+    return 1; // Busy
+}
+
+#endif /* _SPINLOCK_FUTEX_H */
@@ -14,7 +14,9 @@
 #define cmpxchg(P, O, N) __sync_val_compare_and_swap((P), (O), (N))
 
 #define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
 #define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
 
 static inline void *xchg_64(void *ptr, void *x)
 {
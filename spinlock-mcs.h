@@ -4,7 +4,9 @@
 #define cmpxchg(P, O, N) __sync_val_compare_and_swap((P), (O), (N))
 
 #define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
 #define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
 
 static inline void *xchg_64(void *ptr, void *x)
 {
@@ -72,7 +74,7 @@ static inline int trylock_mcs(mcs_lock *m, mcs_lock_t *me)
     me->spin = 0;
     
     /* Try to lock */
-    tail = cmpxchg(m, NULL, &me);
+    tail = cmpxchg(m, NULL, me);
     
     /* No one was there - can quickly return */
     if (!tail) return 0;
@@ -0,0 +1,56 @@
+#ifndef _SPINLOCK_PARTITIONED_TICKET_H
+#define _SPINLOCK_PARTITIONED_TICKET_H
+
+/* Partitioned ticket lock by Dave Dice.
+ *
+ * The now serving counter of the ticket lock is split into PTICKET_SLOTS
+ * padded grant words, a thread holding ticket t waits for grant[t % slots]
+ * to become t. Waiters are spread over different cache lines, so unlock
+ * invalidates the line of roughly waiters / PTICKET_SLOTS threads instead of
+ * every waiter, and unlike the Anderson lock any number of threads may wait.
+ *
+ * Tickets are 32 bits (16 in spinlock-ticket.h) and can't wrap unless 4G
+ * threads wait. PTICKET_SLOTS must be a power of two. All zero is unlocked. */
+
+#define atomic_xadd(P, V) __sync_fetch_and_add((P), (V))
+
+#define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+#ifndef PTICKET_SLOTS
+#define PTICKET_SLOTS 16
+#endif
+
+typedef struct pticket_grant pticket_grant;
+struct pticket_grant
+{
+    volatile unsigned grant;
+} __attribute__((aligned(64)));
+
+typedef struct pticketlock pticketlock;
+struct pticketlock
+{
+    unsigned request __attribute__((aligned(64)));
+    unsigned owner; /* Ticket of the lock owner, only used by the owner. */
+    pticket_grant slot[PTICKET_SLOTS];
+};
+
+static inline void pticket_lock(pticketlock *l)
+{
+    unsigned me = atomic_xadd(&l->request, 1);
+
+    while (l->slot[me % PTICKET_SLOTS].grant != me) cpu_relax();
+    l->owner = me;
+}
+
+static inline void pticket_unlock(pticketlock *l)
+{
+    unsigned next = l->owner + 1;
+
+    barrier();
+    l->slot[next % PTICKET_SLOTS].grant = next;
+}
+
+#endif /* _SPINLOCK_PARTITIONED_TICKET_H */
@@ -0,0 +1,188 @@
+#ifndef _SPINLOCK_QSPINLOCK
+#define _SPINLOCK_QSPINLOCK
+
+/* Queued spinlock in 4 bytes, after the Linux kernel qspinlock.
+ *
+ * The word holds the locked byte, the pending byte and a 16 bit tail naming
+ * the last MCS node in the queue. Uncontended lock is one cmpxchg. The first
+ * contender sets pending and spins on the lock word itself, so two threads
+ * never touch a queue node. Further contenders queue on MCS nodes and spin
+ * on their own node, only the head of the queue spins on the lock word.
+ *
+ * Nodes are per thread and static, so no node is passed to lock and unlock.
+ * Each thread has QSPIN_NODES of them, one per lock it may be waiting for at
+ * the same time (a signal handler taking a lock while the thread waits for
+ * another). The tail encodes the thread's slot plus one and the node index.
+ * Slots are taken on the first contended lock and given back when the thread
+ * exits, at most QSPIN_MAX_THREADS threads may exist at the same time. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+#define QSPIN_LOCKED 1U
+#define QSPIN_PENDING (1U << 8)
+#define QSPIN_LOCKED_PENDING 0xffffU
+#define QSPIN_TAIL_SHIFT 16
+
+#define QSPIN_IDX_BITS 2
+#define QSPIN_NODES (1 << QSPIN_IDX_BITS)
+#define QSPIN_MAX_THREADS ((1 << (16 - QSPIN_IDX_BITS)) - 1)
+
+/* Pause iterations to wait for a pending thread to take over the lock before
+ * queueing. */
+#define QSPIN_PENDING_LOOPS 256
+
+/* All zero is unlocked. */
+typedef union qspinlock qspinlock;
+union qspinlock
+{
+    volatile uint32_t val;
+    struct {
+        volatile uint8_t locked;
+        volatile uint8_t pending;
+    };
+    struct {
+        volatile uint16_t locked_pending;
+        volatile uint16_t tail;
+    };
+};
+
+typedef struct qspin_node qspin_node;
+struct qspin_node
+{
+    qspin_node *volatile next;
+    volatile int locked;
+};
+
+/* A thread's nodes share one cache line. */
+static struct {
+    qspin_node node[QSPIN_NODES];
+} __attribute__((aligned(64))) qspin_nodes[QSPIN_MAX_THREADS];
+
+static volatile char qspin_used[QSPIN_MAX_THREADS];
+static pthread_key_t qspin_key;
+static pthread_once_t qspin_once = PTHREAD_ONCE_INIT;
+static __thread int qspin_slot = -1;
+static __thread int qspin_depth; /* Nodes in use by this thread. */
+
+static void qspin_thread_exit(void *slot)
+{
+    qspin_used[(intptr_t)slot - 1] = 0;
+}
+
+static void qspin_key_init(void)
+{
+    if (pthread_key_create(&qspin_key, qspin_thread_exit) != 0)
+        abort();
+}
+
+static int qspin_register(void)
+{
+    pthread_once(&qspin_once, qspin_key_init);
+    for (int i = 0; i < QSPIN_MAX_THREADS; i++) {
+        if (!qspin_used[i] && __sync_bool_compare_and_swap(&qspin_used[i], 0, 1)) {
+            pthread_setspecific(qspin_key, (void *)(intptr_t)(i + 1));
+            qspin_slot = i;
+            return i;
+        }
+    }
+    abort();
+}
+
+static inline qspin_node *qspin_decode(uint16_t tail)
+{
+    return &qspin_nodes[(tail >> QSPIN_IDX_BITS) - 1]
+        .node[tail & (QSPIN_NODES - 1)];
+}
+
+static void qspin_lock_slow(qspinlock *l, uint32_t val)
+{
+    qspin_node *node, *next;
+    uint16_t tail, prev;
+    int slot, idx;
+
+    /* A pending thread is about to take the lock, give it a moment. */
+    for (int i = 0; val == QSPIN_PENDING && i < QSPIN_PENDING_LOOPS; i++) {
+        cpu_relax();
+        val = l->val;
+    }
+    if (val & ~QSPIN_LOCKED) goto queue;
+
+    /* Only the lock holder is there, become the pending thread. */
+    val = __sync_fetch_and_or(&l->val, QSPIN_PENDING);
+    if (val & ~QSPIN_LOCKED) {
+        /* Someone else got there first. Undo pending unless it was theirs. */
+        if (!(val & QSPIN_PENDING))
+            __sync_fetch_and_and(&l->val, ~QSPIN_PENDING);
+        goto queue;
+    }
+    while (l->locked) cpu_relax();
+    /* Clear pending and take the lock in one store. */
+    l->locked_pending = QSPIN_LOCKED;
+    return;
+
+queue:
+    slot = qspin_slot;
+    if (slot < 0) slot = qspin_register();
+    idx = qspin_depth++;
+    if (idx >= QSPIN_NODES) abort();
+    node = &qspin_nodes[slot].node[idx];
+    tail = (slot + 1) << QSPIN_IDX_BITS | idx;
+
+    node->next = NULL;
+    node->locked = 0;
+
+    /* xchg is a full barrier, the node is initialized before it's visible. */
+    prev = __sync_lock_test_and_set(&l->tail, tail);
+    next = NULL;
+    if (prev) {
+        qspin_decode(prev)->next = node;
+        while (!node->locked) cpu_relax();
+        next = node->next;
+    }
+
+    /* Head of the queue, wait for the owner and the pending thread. */
+    while ((val = l->val) & QSPIN_LOCKED_PENDING) cpu_relax();
+
+    /* Last in the queue: take the lock and clear the tail together. */
+    if ((val >> QSPIN_TAIL_SHIFT) == tail &&
+        __sync_bool_compare_and_swap(&l->val, val, QSPIN_LOCKED))
+        goto done;
+
+    l->locked = 1;
+    if (!next)
+        while (!(next = node->next)) cpu_relax();
+    next->locked = 1;
+
+done:
+    qspin_depth--;
+}
+
+static inline void qspin_lock(qspinlock *l)
+{
+    uint32_t val = __sync_val_compare_and_swap(&l->val, 0, QSPIN_LOCKED);
+
+    if (val) qspin_lock_slow(l, val);
+}
+
+static inline void qspin_unlock(qspinlock *l)
+{
+    barrier();
+    l->locked = 0;
+}
+
+static inline int qspin_trylock(qspinlock *l)
+{
+    if (!l->val && __sync_bool_compare_and_swap(&l->val, 0, QSPIN_LOCKED))
+        return 0;
+
+    return 1; // Busy
+}
+
+#endif
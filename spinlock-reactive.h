@@ -0,0 +1,112 @@
+#ifndef _SPINLOCK_REACTIVE
+#define _SPINLOCK_REACTIVE
+
+/* Reactive lock switching between test-and-set and MCS queue mode, after
+ * "Reactive Synchronization Algorithms for Multiprocessors" by Lim and
+ * Agarwal.
+ *
+ * The locked word always provides mutual exclusion. In TAS mode threads xchg
+ * it directly, which is cheapest with few contenders. In queue mode threads
+ * first join an MCS queue and only the head of the queue competes for the
+ * locked word, so waiters spin on their own node instead of the shared word.
+ * As the mode only decides how threads wait for the locked word, switching is
+ * safe at any time: threads which read the old mode just finish waiting the
+ * old way.
+ *
+ * The holder decides the mode after every acquisition. An acquisition is
+ * contended if the xchg failed, the thread waited in the queue or someone
+ * queued behind it. Contended acquisitions raise a score and uncontended ones
+ * lower it, TAS mode switches to queue mode when the score reaches
+ * REACTIVE_TO_QUEUE and queue mode switches back when it reaches
+ * REACTIVE_TO_TAS. Different thresholds give hysteresis, so occasional
+ * contention doesn't make the lock flap. */
+
+#include "spinlock-mcs.h"
+
+#ifndef REACTIVE_TO_QUEUE
+#define REACTIVE_TO_QUEUE 16
+#endif
+#ifndef REACTIVE_TO_TAS
+#define REACTIVE_TO_TAS 256
+#endif
+
+#define REACTIVE_TAS 0
+#define REACTIVE_QUEUE 1
+
+/* All zero is unlocked in TAS mode. */
+typedef struct reactivelock reactivelock;
+struct reactivelock
+{
+    volatile unsigned locked;
+    volatile int mode;
+    /* Only accessed by the holder. */
+    int score;
+    unsigned long switches;
+    /* Joining the queue doesn't touch the locked word's cache line. */
+    mcs_lock queue __attribute__((aligned(64)));
+};
+
+static inline int reactive_xchg(reactivelock *l)
+{
+    return __sync_lock_test_and_set(&l->locked, 1);
+}
+
+/* Return whether the lock had to be waited for. */
+static inline int reactive_wait(reactivelock *l)
+{
+    int contended = 0;
+
+    while (reactive_xchg(l)) {
+        contended = 1;
+        while (l->locked) cpu_relax();
+    }
+    return contended;
+}
+
+/* Called by the holder. The score counts towards the other mode. */
+static inline void reactive_adapt(reactivelock *l, int contended)
+{
+    int tas = l->mode == REACTIVE_TAS;
+
+    if (contended != tas) {
+        if (l->score) l->score--;
+        return;
+    }
+    if (++l->score < (tas ? REACTIVE_TO_QUEUE : REACTIVE_TO_TAS))
+        return;
+    l->mode = tas ? REACTIVE_QUEUE : REACTIVE_TAS;
+    l->score = 0;
+    l->switches++;
+}
+
+static inline void reactive_lock(reactivelock *l)
+{
+    mcs_lock_t me;
+    int contended;
+
+    if (l->mode == REACTIVE_TAS) {
+        contended = reactive_wait(l);
+    } else {
+        lock_mcs(&l->queue, &me);
+        contended = reactive_wait(l) | me.spin;
+        /* A successor, or one between its xchg and linking in. */
+        if (me.next || l->queue != &me)
+            contended = 1;
+        unlock_mcs(&l->queue, &me);
+    }
+    reactive_adapt(l, contended);
+}
+
+static inline void reactive_unlock(reactivelock *l)
+{
+    __sync_lock_release(&l->locked);
+}
+
+static inline int reactive_trylock(reactivelock *l)
+{
+    if (!reactive_xchg(l)) return 0;
+
+    return 1; // Busy
+}
+
+#endif
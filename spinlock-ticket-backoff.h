@@ -0,0 +1,69 @@
+#ifndef _SPINLOCK_TICKET_BACKOFF_H
+#define _SPINLOCK_TICKET_BACKOFF_H
+
+/* Ticket lock with proportional backoff.
+ *
+ * A waiter knows how many threads are ahead of it, ticket - now serving.
+ * Instead of polling the shared word continuously it waits for that distance
+ * times TICKET_BACKOFF_BASE pause instructions before reading it again, so
+ * waiters far back in the queue generate almost no coherence traffic.
+ *
+ * ticket and users are 32 bits (16 in spinlock-ticket.h) and can't wrap. All
+ * zero is unlocked. */
+
+#include <stdint.h>
+
+#define atomic_xadd(P, V) __sync_fetch_and_add((P), (V))
+
+#define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+/* The proportional wait is this lock's own backoff, not a backoff.h one. */
+#define ticketbo_pause() asm volatile("pause\n": : :"memory")
+
+#ifndef TICKET_BACKOFF_BASE
+#define TICKET_BACKOFF_BASE 32
+#endif
+
+typedef union ticketbolock ticketbolock;
+
+union ticketbolock
+{
+    uint64_t u;
+    struct
+    {
+        volatile uint32_t ticket;
+        uint32_t users;
+    } s;
+};
+
+static inline void ticketbo_lock(ticketbolock *t)
+{
+    uint32_t me = atomic_xadd(&t->s.users, 1);
+    uint32_t dist;
+
+    while ((dist = me - t->s.ticket) != 0) {
+        for (uint32_t i = 0; i < dist * TICKET_BACKOFF_BASE; i++)
+            ticketbo_pause();
+    }
+}
+
+static inline void ticketbo_unlock(ticketbolock *t)
+{
+    barrier();
+    t->s.ticket++;
+}
+
+static inline int ticketbo_trylock(ticketbolock *t)
+{
+    uint32_t me = t->s.users;
+    uint64_t cmp = ((uint64_t) me << 32) + me;
+    uint64_t cmpnew = ((uint64_t) (me + 1) << 32) + me;
+
+    if (__sync_val_compare_and_swap(&t->u, cmp, cmpnew) == cmp) return 0;
+
+    return 1; // Busy
+}
+
+#endif /* _SPINLOCK_TICKET_BACKOFF_H */
@@ -7,7 +7,14 @@
 #define atomic_xadd(P, V) __sync_fetch_and_add((P), (V))
 
 #define barrier() asm volatile("": : :"memory")
+#ifndef cpu_relax
 #define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+
+/* Wait while d threads are ahead in the queue. */
+#ifndef cpu_relax_dist
+#define cpu_relax_dist(d) cpu_relax()
+#endif
 
 #define spin_lock ticket_lock
 #define spin_unlock ticket_unlock
@@ -31,7 +38,8 @@ static inline void ticket_lock(ticketlock *t)
 {
     unsigned short me = atomic_xadd(&t->s.users, 1);
     
-    while (t->s.ticket != me) cpu_relax();
+    while (t->s.ticket != me)
+        cpu_relax_dist((unsigned short)(me - t->s.ticket));
 }
 
 static inline void ticket_unlock(ticketlock *t)
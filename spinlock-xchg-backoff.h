@@ -2,7 +2,9 @@
 #define _SPINLOCK_XCHG_BACKOFF_H
 
 /* Spin lock using xchg. Added backoff wait to avoid concurrent lock/unlock
- * operation.
+ * operation. The wait counts pause instructions and doubles up to
+ * XCHG_BACKOFF_MAX. For waits in ns use the xchg lock with a backoff.h
+ * policy instead, this lock always uses its own backoff.
  * Original code copied from http://locklessinc.com/articles/locks/
  */
 
@@ -10,7 +12,14 @@
 #define barrier() asm volatile("": : :"memory")
 
 /* Pause instruction to prevent excess processor bus usage */
+#ifndef cpu_relax
 #define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
+#define xchg_backoff_pause() asm volatile("pause\n": : :"memory")
+
+#ifndef XCHG_BACKOFF_MAX
+#define XCHG_BACKOFF_MAX 1024
+#endif
 
 static inline unsigned short xchg_8(void *ptr, unsigned char x)
 {
@@ -35,12 +44,14 @@ static inline void spin_lock(spinlock *lock)
     
         // wait here is important to performance.
         for (int i = 0; i < wait; i++) {
-            cpu_relax();
+            xchg_backoff_pause();
         }
         while (*lock) {
-            wait *= 2; // exponential backoff if can't get lock
+            // exponential backoff if can't get lock
+            if (wait < XCHG_BACKOFF_MAX)
+                wait *= 2;
             for (int i = 0; i < wait; i++) {
-                cpu_relax();
+                xchg_backoff_pause();
             }
         }
     }
@@ -9,7 +9,9 @@
 #define barrier() asm volatile("": : :"memory")
 
 /* Pause instruction to prevent excess processor bus usage */
+#ifndef cpu_relax
 #define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
 
 #define __HLE_ACQUIRE ".byte 0xf2 ; "
 #define __HLE_RELEASE ".byte 0xf3 ; "
@@ -9,7 +9,9 @@
 #define barrier() asm volatile("": : :"memory")
 
 /* Pause instruction to prevent excess processor bus usage */
+#ifndef cpu_relax
 #define cpu_relax() asm volatile("pause\n": : :"memory")
+#endif
 
 static inline unsigned short xchg_8(void *ptr, unsigned char x)
 {
@@ -0,0 +1,475 @@
+#ifndef _SPINLOCK_HPP
+#define _SPINLOCK_HPP
+
+/* Header only C++ versions of the spinlock-*.h locks.
+ *
+ * Every lock is a class template meeting Lockable (lock, try_lock, unlock),
+ * so std::lock_guard, std::unique_lock and std::scoped_lock work with it, and
+ * several locks can be used in one translation unit. Everything lives in
+ * namespace spin and no macros are defined.
+ *
+ * Two policies are template parameters resolved at compile time:
+ *
+ * Backoff: how to wait for the lock. An object is created for each
+ * acquisition and pause() is called once per unsuccessful check. relax only
+ * executes pause, exp_backoff doubles the number of pauses each time,
+ * calibrated waits as set at runtime by backoff_configure (backoff.h).
+ *
+ * Padding: no_padding or cache_padded. The lock state, and for queue locks
+ * every queue node, is wrapped in Padding::cell<T>, which derives from T and
+ * is cache line aligned for cache_padded.
+ *
+ * The algorithms and memory accesses are the same as in the C headers, using
+ * the GCC __atomic builtins on plain fields, so the generated code matches
+ * the inline C. */
+
+#include <cstddef>
+#include <cstdint>
+#include "backoff.h"
+
+namespace spin {
+
+constexpr std::size_t cache_line = 64;
+
+inline void cpu_relax() noexcept
+{
+    asm volatile("pause\n": : :"memory");
+}
+
+/* Backoff policies. */
+
+struct relax {
+    static constexpr const char *name = "relax";
+    void pause() noexcept { cpu_relax(); }
+};
+
+template <unsigned Min = 1, unsigned Max = 1024>
+struct exp_backoff {
+    static constexpr const char *name = "exp";
+    unsigned wait = Min;
+
+    void pause() noexcept
+    {
+        for (unsigned i = 0; i < wait; i++)
+            cpu_relax();
+        if (wait < Max)
+            wait *= 2;
+    }
+};
+
+/* Budgets in ns instead of pause counts, shares the global policy with the C
+ * locks. Threads ahead in the queue are not known here, prop waits as for
+ * one. */
+struct calibrated {
+    static constexpr const char *name = "calibrated";
+    ::backoff b{};
+
+    void pause() noexcept { backoff_pause(&b); }
+};
+
+/* Padding policies. */
+
+struct no_padding {
+    static constexpr const char *name = "none";
+    template <class T> struct cell : T {};
+};
+
+struct cache_padded {
+    static constexpr const char *name = "line";
+    template <class T> struct alignas(cache_line) cell : T {};
+};
+
+/* Base class, locks are neither copyable nor movable. */
+class lock_base {
+public:
+    lock_base() = default;
+    lock_base(const lock_base &) = delete;
+    lock_base &operator=(const lock_base &) = delete;
+};
+
+/* Test and test and set lock with xchg, spinlock-xchg.h. */
+template <class Backoff = relax, class Padding = no_padding>
+class xchg_lock : lock_base {
+public:
+    static constexpr const char *name = "xchg";
+    using backoff_policy = Backoff;
+    using padding_policy = Padding;
+
+    void lock() noexcept
+    {
+        Backoff b;
+
+        while (__atomic_exchange_n(&s_.locked, 1, __ATOMIC_ACQUIRE)) {
+            while (__atomic_load_n(&s_.locked, __ATOMIC_RELAXED))
+                b.pause();
+        }
+    }
+
+    bool try_lock() noexcept
+    {
+        return !__atomic_exchange_n(&s_.locked, 1, __ATOMIC_ACQUIRE);
+    }
+
+    void unlock() noexcept
+    {
+        __atomic_store_n(&s_.locked, 0, __ATOMIC_RELEASE);
+    }
+
+private:
+    struct state {
+        unsigned char locked;
+    };
+    typename Padding::template cell<state> s_{};
+};
+
+/* The xchg-backoff lock is the xchg lock with exponential backoff. */
+template <class Padding = no_padding>
+using backoff_lock = xchg_lock<exp_backoff<>, Padding>;
+
+/* Lock spinning with cmpxchg, spinlock-cmpxchg.h. Every attempt writes the
+ * lock's cache line, which is why it doesn't scale. */
+template <class Backoff = relax, class Padding = no_padding>
+class cmpxchg_lock : lock_base {
+public:
+    static constexpr const char *name = "cmpxchg";
+    using backoff_policy = Backoff;
+    using padding_policy = Padding;
+
+    void lock() noexcept
+    {
+        Backoff b;
+
+        while (!try_lock())
+            b.pause();
+    }
+
+    bool try_lock() noexcept
+    {
+        unsigned char expected = 0;
+
+        return __atomic_compare_exchange_n(&s_.locked, &expected, 1, false,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+    void unlock() noexcept
+    {
+        __atomic_store_n(&s_.locked, 0, __ATOMIC_RELEASE);
+    }
+
+private:
+    struct state {
+        unsigned char locked;
+    };
+    typename Padding::template cell<state> s_{};
+};
+
+/* Ticket lock with 16 bit tickets, spinlock-ticket.h. */
+template <class Backoff = relax, class Padding = no_padding>
+class ticket_lock : lock_base {
+public:
+    static constexpr const char *name = "ticket";
+    using backoff_policy = Backoff;
+    using padding_policy = Padding;
+
+    void lock() noexcept
+    {
+        Backoff b;
+        std::uint16_t me = __atomic_fetch_add(&s_.s.users, 1, __ATOMIC_RELAXED);
+
+        while (__atomic_load_n(&s_.s.ticket, __ATOMIC_ACQUIRE) != me)
+            b.pause();
+    }
+
+    bool try_lock() noexcept
+    {
+        std::uint16_t me = __atomic_load_n(&s_.s.users, __ATOMIC_RELAXED);
+        std::uint32_t cmp = ((std::uint32_t)me << 16) + me;
+        std::uint32_t next = ((std::uint32_t)(std::uint16_t)(me + 1) << 16) + me;
+
+        return __atomic_compare_exchange_n(&s_.u, &cmp, next, false,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+    void unlock() noexcept
+    {
+        __atomic_store_n(&s_.s.ticket, s_.s.ticket + 1, __ATOMIC_RELEASE);
+    }
+
+private:
+    struct state {
+        union {
+            std::uint32_t u;
+            struct {
+                std::uint16_t ticket;
+                std::uint16_t users;
+            } s;
+        };
+    };
+    typename Padding::template cell<state> s_{};
+};
+
+/* K42 lock, spinlock-k42.h. An MCS variant which needs no queue node from
+ * the caller: waiters queue nodes on their stack, the lock itself is the node
+ * of the holder. */
+template <class Backoff = relax, class Padding = no_padding>
+class k42_lock : lock_base {
+public:
+    static constexpr const char *name = "k42";
+    using backoff_policy = Backoff;
+    using padding_policy = Padding;
+
+    void lock() noexcept
+    {
+        Backoff b;
+        typename Padding::template cell<node> me{};
+        node *pred, *succ;
+
+        pred = __atomic_exchange_n(&s_.tail, &me, __ATOMIC_ACQ_REL);
+        if (pred) {
+            me.tail = reinterpret_cast<node *>(1);
+            __atomic_store_n(&pred->next, &me, __ATOMIC_RELEASE);
+
+            while (__atomic_load_n(&me.tail, __ATOMIC_ACQUIRE))
+                b.pause();
+        }
+
+        succ = __atomic_load_n(&me.next, __ATOMIC_ACQUIRE);
+        if (!succ) {
+            node *expected = &me;
+
+            __atomic_store_n(&s_.next, nullptr, __ATOMIC_RELAXED);
+            /* Nobody queued behind us, the lock becomes the tail. */
+            if (!__atomic_compare_exchange_n(&s_.tail, &expected, self(), false,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                while (!(succ = __atomic_load_n(&me.next, __ATOMIC_ACQUIRE)))
+                    b.pause();
+                __atomic_store_n(&s_.next, succ, __ATOMIC_RELAXED);
+            }
+        } else {
+            __atomic_store_n(&s_.next, succ, __ATOMIC_RELAXED);
+        }
+    }
+
+    bool try_lock() noexcept
+    {
+        node *expected = nullptr;
+
+        return __atomic_compare_exchange_n(&s_.tail, &expected, self(), false,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+    void unlock() noexcept
+    {
+        Backoff b;
+        node *succ = __atomic_load_n(&s_.next, __ATOMIC_ACQUIRE);
+
+        if (!succ) {
+            node *expected = self();
+
+            if (__atomic_compare_exchange_n(&s_.tail, &expected, nullptr, false,
+                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                return;
+            while (!(succ = __atomic_load_n(&s_.next, __ATOMIC_ACQUIRE)))
+                b.pause();
+        }
+        __atomic_store_n(&succ->tail, nullptr, __ATOMIC_RELEASE);
+    }
+
+private:
+    struct node {
+        node *next;
+        node *tail;
+    };
+    typename Padding::template cell<node> s_{};
+
+    node *self() noexcept { return &s_; }
+};
+
+/* MCS queue lock, spinlock-mcs.h.
+ *
+ * lock(node &) and unlock(node &) take the caller's queue node like the C
+ * version. The Lockable lock() and unlock() take a node from a per thread
+ * cache and remember it in the lock for unlock, only the holder touches that
+ * field. */
+template <class Backoff = relax, class Padding = no_padding>
+class mcs_lock : lock_base {
+    struct node_state {
+        node_state *next;
+        int spin;
+    };
+
+public:
+    static constexpr const char *name = "mcs";
+    using backoff_policy = Backoff;
+    using padding_policy = Padding;
+    using node = typename Padding::template cell<node_state>;
+
+    void lock(node &me) noexcept
+    {
+        Backoff b;
+        node_state *tail;
+
+        me.next = nullptr;
+        me.spin = 0;
+        tail = __atomic_exchange_n(&s_.tail, &me, __ATOMIC_ACQ_REL);
+        if (!tail)
+            return;
+        __atomic_store_n(&tail->next, &me, __ATOMIC_RELEASE);
+
+        while (!__atomic_load_n(&me.spin, __ATOMIC_ACQUIRE))
+            b.pause();
+    }
+
+    bool try_lock(node &me) noexcept
+    {
+        node_state *expected = nullptr;
+
+        me.next = nullptr;
+        me.spin = 0;
+        return __atomic_compare_exchange_n(&s_.tail, &expected, &me, false,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+    void unlock(node &me) noexcept
+    {
+        Backoff b;
+        node_state *succ = __atomic_load_n(&me.next, __ATOMIC_ACQUIRE);
+
+        if (!succ) {
+            node_state *expected = &me;
+
+            if (__atomic_compare_exchange_n(&s_.tail, &expected, nullptr, false,
+                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                return;
+            while (!(succ = __atomic_load_n(&me.next, __ATOMIC_ACQUIRE)))
+                b.pause();
+        }
+        __atomic_store_n(&succ->spin, 1, __ATOMIC_RELEASE);
+    }
+
+    void lock() noexcept
+    {
+        node *n = get_node();
+
+        lock(*n);
+        h_.holder = n;
+    }
+
+    bool try_lock() noexcept
+    {
+        node *n = get_node();
+
+        if (!try_lock(*n)) {
+            put_node(n);
+            return false;
+        }
+        h_.holder = n;
+        return true;
+    }
+
+    void unlock() noexcept
+    {
+        node *n = h_.holder;
+
+        unlock(*n);
+        put_node(n);
+    }
+
+private:
+    struct state {
+        node_state *tail;
+    };
+    struct holder_state {
+        node *holder;
+    };
+    typename Padding::template cell<state> s_{};
+    typename Padding::template cell<holder_state> h_{};
+
+    /* Free nodes of this thread, linked through next. */
+    struct node_cache {
+        node *free = nullptr;
+
+        ~node_cache()
+        {
+            while (free) {
+                node *n = free;
+                free = static_cast<node *>(n->next);
+                delete n;
+            }
+        }
+    };
+
+    static node_cache &cache() noexcept
+    {
+        static thread_local node_cache c;
+        return c;
+    }
+
+    static node *get_node()
+    {
+        node_cache &c = cache();
+        node *n = c.free;
+
+        if (!n)
+            return new node();
+        c.free = static_cast<node *>(n->next);
+        return n;
+    }
+
+    static void put_node(node *n) noexcept
+    {
+        node_cache &c = cache();
+
+        n->next = c.free;
+        c.free = n;
+    }
+};
+
+/* xchg lock with HLE prefixes, spinlock-xchg-hle.h. CPUs without HLE ignore
+ * the prefixes. */
+template <class Backoff = relax, class Padding = no_padding>
+class hle_lock : lock_base {
+public:
+    static constexpr const char *name = "hle";
+    using backoff_policy = Backoff;
+    using padding_policy = Padding;
+
+    void lock() noexcept
+    {
+        Backoff b;
+
+        while (xchg_acquire(1)) {
+            while (__atomic_load_n(&s_.locked, __ATOMIC_RELAXED))
+                b.pause();
+        }
+    }
+
+    bool try_lock() noexcept
+    {
+        return !xchg_acquire(1);
+    }
+
+    void unlock() noexcept
+    {
+        asm volatile(".byte 0xf3 ; movb $0, %0" : "=m"(s_.locked) : : "memory");
+    }
+
+private:
+    struct state {
+        unsigned char locked;
+    };
+    typename Padding::template cell<state> s_{};
+
+    unsigned char xchg_acquire(unsigned char x) noexcept
+    {
+        asm volatile(".byte 0xf2 ; xchgb %0,%1"
+                : "+r"(x), "+m"(s_.locked)
+                :
+                : "memory");
+        return x;
+    }
+};
+
+} /* namespace spin */
+
+#endif /* _SPINLOCK_HPP */
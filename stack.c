@@ -1,15 +1,59 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <pthread.h>
+#include <getopt.h>
 #include <stdio.h>
-#include "spinlock-pthread.h"
+#include <time.h>
+#include <signal.h>
+#include "bench.h"
+#include "hist.h"
+#include "tsc.h"
+#include "pool.h"
+#include "percpu.h"
+#include "lockstat.h"
+#include "work.h"
 
 /*
- * Naive implementation of lock-free stack which does not handle ABA problem.
- * This works if only one thread is doing pop.
+ * Concurrent stack benchmark. The stack variant, the lock used by the locked
+ * variant, the number of producer, consumer and mixed threads and the run
+ * time are chosen on the command line.
+ *
+ * Variants:
+ *
+ * locked: push and pop under any lock from the spinbench lock table.
+ *
+ * delegated: push and pop handed to the lock as functions. With a delegating
+ * lock (fc) another thread may run them, any other lock runs them locally.
+ *
+ * lockfree: naive implementation of lock-free stack which does not handle
+ * ABA problem. This works if only one thread is doing pop.
+ *
+ * tagged: handles ABA, top is a pointer plus a counter updated together with
+ * cmpxchg16b. Every successful update bumps the counter, so a pop which read
+ * top, got delayed, and sees the same pointer again after other threads
+ * popped and pushed it back still fails its CAS. Popped nodes are never
+ * returned to the system while the benchmark runs, so reading next from a
+ * node already popped by another thread is safe.
+ *
+ * elimination: tagged with elimination backoff.
+ *
+ * percpu, percpu-atomic: a stack per CPU (percpu.h), updated with restartable
+ * sequences or under a test-and-set lock per CPU. Pop only sees the list of
+ * the CPU the thread runs on, so it can come back empty while other CPUs hold
+ * nodes. This is a freelist rather than a stack.
+ *
+ * Nodes come from per thread pools (pool.h) and poppers give them back. Pool
+ * memory stays a Node until the pool is destroyed, so the stale next reads
+ * above remain safe, and the benchmark measures the stack instead of malloc.
+ * With --alloc=malloc every push mallocs a node which is never freed.
  *
  * For lock-free stack which handles ABA problem, see streamflow.
  */
 
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+
 /* Return 1 if swap happened. */
 static inline unsigned int compare_and_swap(volatile void *address,
         void *old_value, void *new_value)
@@ -24,175 +68,709 @@ static inline unsigned int compare_and_swap(volatile void *address,
     return prev == old_value;
 }
 
-/* Flag to use pthread mutex or spinlock, useful when we want to compare the
- * performance of different implementation. */
-/*#define MUTEX*/
-/*#define SPINLOCK*/
+/* 16 byte compare and swap of (ptr, tag). Return 1 if swap happened. */
+static inline unsigned int compare_and_swap2(volatile void *address,
+        void *old_ptr, uintptr_t old_tag, void *new_ptr, uintptr_t new_tag)
+{
+    char ok;
+
+    asm volatile("lock; cmpxchg16b %1; setz %0"
+        : "=q"(ok), "+m"(*(__int128 *)address), "+a"(old_ptr), "+d"(old_tag)
+        : "b"(new_ptr), "c"(new_tag)
+        : "memory", "cc");
+
+    return ok;
+}
 
 typedef struct Node {
     struct Node *next;
-    int val;
+    uint64_t val;
 } Node;
 
 typedef struct {
-    volatile Node *top;
-#ifdef MUTEX
-    pthread_mutex_t mutex;
-#elif defined(SPINLOCK)
-    Spinlock slock;
-#endif
+    /* Must be 16 byte aligned for cmpxchg16b. Only the tagged variants use
+     * tag. */
+    struct {
+        Node *volatile ptr;
+        volatile uintptr_t tag;
+    } top __attribute__((aligned(16)));
+    /* Locked and delegated variants only. */
+    const struct bench_lock *lock;
+    void *l;
+    /* Per CPU variants only. */
+    struct percpu_stack pcpu;
 } Stack;
 
-Stack gstack;
+static Stack gstack;
 
-#if defined(MUTEX) || defined(SPINLOCK)
+/* Locked version. */
+static void push_locked(Stack *stack, Node *n, void *lnode) {
+    stack->lock->acquire(stack->l, lnode);
+    n->next = stack->top.ptr;
+    stack->top.ptr = n;
+    stack->lock->release(stack->l, lnode);
+}
 
-void push(Stack *stack, Node *n) {
-#ifdef MUTEX
-    pthread_mutex_lock(&stack->mutex);
-#elif defined(SPINLOCK)
-    spin_lock(&stack->slock);
-#endif
+static Node *pop_locked(Stack *stack, void *lnode) {
+    Node *oldtop;
 
-    n->next = (Node *)stack->top;
-    stack->top = n;
+    if (stack->top.ptr == NULL)
+        return NULL;
 
-#ifdef MUTEX
-    pthread_mutex_unlock(&stack->mutex);
-#elif defined(SPINLOCK)
-    spin_unlock(&stack->slock);
-#endif
+    stack->lock->acquire(stack->l, lnode);
+    oldtop = stack->top.ptr;
+    if (oldtop != NULL)
+        stack->top.ptr = oldtop->next;
+    stack->lock->release(stack->l, lnode);
+
+    return oldtop;
 }
 
-Node *pop(Stack *stack) {
-    Node *oldtop;
+/* Delegated version: push and pop are functions run through the lock's
+ * execute, so a delegating lock like fc runs them all on the combiner and top
+ * stays in its cache. */
+struct push_req {
+    Stack *stack;
+    Node *n;
+};
 
-    if (stack->top == NULL)
-        return NULL;
+static void *push_fn(void *arg) {
+    struct push_req *r = arg;
 
-#ifdef MUTEX
-    pthread_mutex_lock(&stack->mutex);
-#elif defined(SPINLOCK)
-    spin_lock(&stack->slock);
-#endif
-    oldtop = (Node *)stack->top;
-    stack->top = oldtop->next;
+    r->n->next = r->stack->top.ptr;
+    r->stack->top.ptr = r->n;
+    return NULL;
+}
 
-#ifdef MUTEX
-    pthread_mutex_unlock(&stack->mutex);
-#elif defined(SPINLOCK)
-    spin_unlock(&stack->slock);
-#endif
+static void *pop_fn(void *arg) {
+    Stack *stack = arg;
+    Node *oldtop = stack->top.ptr;
 
+    if (oldtop != NULL)
+        stack->top.ptr = oldtop->next;
     return oldtop;
 }
 
-#else
+static void push_delegated(Stack *stack, Node *n, void *lnode) {
+    struct push_req r = { stack, n };
+
+    stack->lock->execute(stack->l, lnode, push_fn, &r);
+}
+
+static Node *pop_delegated(Stack *stack, void *lnode) {
+    if (stack->top.ptr == NULL)
+        return NULL;
+
+    return stack->lock->execute(stack->l, lnode, pop_fn, stack);
+}
 
 /* Lock free version. */
-void push(Stack *stack, Node *n) {
+static void push_lockfree(Stack *stack, Node *n, void *lnode) {
     Node *oldtop;
     while (1) {
-        oldtop = (Node *)stack->top;
+        oldtop = stack->top.ptr;
         n->next = oldtop;
-        if (compare_and_swap(&stack->top, oldtop, n))
+        if (compare_and_swap(&stack->top.ptr, oldtop, n))
             return;
     }
 }
 
-Node *pop(Stack *stack) {
+static Node *pop_lockfree(Stack *stack, void *lnode) {
     Node *oldtop, *next;
 
     while (1) {
-        oldtop = (Node *)stack->top;
+        oldtop = stack->top.ptr;
         if (oldtop == NULL)
             return NULL;
         next = oldtop->next;
-        if (compare_and_swap(&stack->top, oldtop, next))
+        if (compare_and_swap(&stack->top.ptr, oldtop, next))
             return oldtop;
     }
 }
 
-#endif
+/* ABA safe lock free version. Return 0 if the CAS failed. */
+static inline int tagged_try_push(Stack *stack, Node *n) {
+    /* A torn read of (tag, ptr) only makes the CAS fail. */
+    uintptr_t tag = stack->top.tag;
+    Node *oldtop = stack->top.ptr;
 
-/* Testing code. */
+    n->next = oldtop;
+    return compare_and_swap2(&stack->top, oldtop, tag, n, tag + 1);
+}
 
-#define NITERS 2000000 /* Number of pushes for each push thread. */
-#define NTHR 3 /* Number of push threads. */
+/* Set *n to the popped node, NULL if the stack is empty. */
+static inline int tagged_try_pop(Stack *stack, Node **n) {
+    uintptr_t tag = stack->top.tag;
+    Node *oldtop = stack->top.ptr;
 
-void *pusher(void *dummy) {
-    long i, tid = (long) dummy;
-    for (i = 0; i < NITERS; i++) {
-        Node *n = malloc(sizeof(*n));
-        n->val = NTHR * i + tid;
-        push(&gstack, n);
+    *n = oldtop;
+    if (oldtop == NULL)
+        return 1;
+    return compare_and_swap2(&stack->top, oldtop, tag, oldtop->next, tag + 1);
+}
+
+static void push_tagged(Stack *stack, Node *n, void *lnode) {
+    while (!tagged_try_push(stack, n))
+        ;
+}
+
+static Node *pop_tagged(Stack *stack, void *lnode) {
+    Node *n;
+
+    while (!tagged_try_pop(stack, &n))
+        ;
+    return n;
+}
+
+/*
+ * Elimination backoff stack by Hendler, Shavit and Yerushalmi.
+ *
+ * When the CAS on top fails because of contention, a push and a pop which
+ * meet in the same slot of the elimination array cancel each other out
+ * without touching top: the pusher parks its node in a random slot for a
+ * while, a popper finding a parked node takes it. Each slot is a tagged
+ * pointer for the same ABA reason as top.
+ *
+ * Every thread picks slots from the first elim_range entries. The range
+ * doubles when the chosen slot was already busy (many threads are
+ * eliminating) and halves when nobody showed up, so threads spread over more
+ * slots only under high contention.
+ */
+
+#define ELIM_SLOTS 16  /* Maximum elimination array size. */
+#define ELIM_SPIN 128  /* Iterations a pusher waits for a popper. */
+
+typedef struct {
+    struct {
+        Node *volatile ptr;
+        volatile uintptr_t tag;
+    } x __attribute__((aligned(16)));
+} __attribute__((aligned(64))) ElimSlot;
+
+static ElimSlot elim[ELIM_SLOTS];
+static __thread int elim_range = 1;
+static __thread unsigned elim_seed;
+
+static inline ElimSlot *elim_pick(void) {
+    if (elim_seed == 0)
+        elim_seed = (unsigned)(uintptr_t)&elim_seed | 1;
+    elim_seed ^= elim_seed << 13;
+    elim_seed ^= elim_seed >> 17;
+    elim_seed ^= elim_seed << 5;
+    return &elim[elim_seed % elim_range];
+}
+
+static inline void elim_grow(void) {
+    if (elim_range < ELIM_SLOTS)
+        elim_range *= 2;
+}
+
+static inline void elim_shrink(void) {
+    if (elim_range > 1)
+        elim_range /= 2;
+}
+
+/* Park n in a slot. Return 1 if a popper took it. */
+static int elim_push(Node *n) {
+    ElimSlot *s = elim_pick();
+    uintptr_t tag = s->x.tag;
+
+    if (s->x.ptr != NULL || !compare_and_swap2(&s->x, NULL, tag, n, tag + 1)) {
+        elim_grow();
+        return 0;
+    }
+    for (int i = 0; i < ELIM_SPIN; i++) {
+        /* Any change of the slot means a popper took n. */
+        if (s->x.ptr != n || s->x.tag != tag + 1)
+            return 1;
+        cpu_relax();
     }
+    /* Nobody came, take n back unless a popper just got it. */
+    if (compare_and_swap2(&s->x, n, tag + 1, NULL, tag + 2)) {
+        elim_shrink();
+        return 0;
+    }
+    return 1;
+}
 
+/* Take a node parked by a pusher, NULL if there's none. */
+static Node *elim_pop(void) {
+    ElimSlot *s = elim_pick();
+    uintptr_t tag = s->x.tag;
+    Node *n = s->x.ptr;
+
+    if (n == NULL) {
+        elim_shrink();
+        return NULL;
+    }
+    if (compare_and_swap2(&s->x, n, tag, NULL, tag + 1))
+        return n;
+    elim_grow();
     return NULL;
 }
 
-static inline void atomic_inc64(volatile unsigned long* address)
-{
-    asm volatile(
-        "lock; incq %0\n\t"
-        : "=m" (*address)
-        : "m" (*address));
+static void push_elimination(Stack *stack, Node *n, void *lnode) {
+    while (!tagged_try_push(stack, n) && !elim_push(n))
+        ;
 }
 
-volatile unsigned long popcount = 0;
+static Node *pop_elimination(Stack *stack, void *lnode) {
+    Node *n;
 
-void *poper(void *dummy) {
+    while (!tagged_try_pop(stack, &n)) {
+        if ((n = elim_pop()) != NULL)
+            break;
+    }
+    return n;
+}
+
+/* Per CPU version, next is the first word of Node as percpu.h expects. */
+static void push_percpu(Stack *stack, Node *n, void *lnode) {
+    percpu_stack_push(&stack->pcpu, n);
+}
+
+static Node *pop_percpu(Stack *stack, void *lnode) {
+    return percpu_stack_pop(&stack->pcpu);
+}
+
+struct stack_variant {
+    const char *name;
+    void (*push)(Stack *stack, Node *n, void *lnode);
+    Node *(*pop)(Stack *stack, void *lnode);
+    int single_popper; /* Only one thread may pop. */
+    int uses_lock;     /* Needs a lock from the lock table. */
+    int percpu;        /* Per CPU stack, with percpu_flags. */
+    int percpu_flags;
+};
+
+static const struct stack_variant variants[] = {
+    { "locked", push_locked, pop_locked, 0, 1 },
+    { "delegated", push_delegated, pop_delegated, 0, 1 },
+    { "lockfree", push_lockfree, pop_lockfree, 1, 0 },
+    { "tagged", push_tagged, pop_tagged, 0, 0 },
+    { "elimination", push_elimination, pop_elimination, 0, 0 },
+    { "percpu", push_percpu, pop_percpu, 0, 0, 1, 0 },
+    { "percpu-atomic", push_percpu, pop_percpu, 0, 0, 1, PERCPU_ATOMIC },
+};
+#define NVARIANTS (sizeof(variants) / sizeof(variants[0]))
+
+/* Testing code. */
+
+/* The lock objects call these from the counter benchmark thread, which is
+ * not used here. */
+void bench_thread_start(struct bench_thread *t) {}
+void bench_thread_end(struct bench_thread *t) {}
+
+static struct {
+    const struct stack_variant *variant;
+    const struct bench_lock *lock;
+    int use_pool;
+    int producers; /* Push only. */
+    int consumers; /* Pop only. */
+    int mixed;     /* Push with probability push_pct, else pop. */
+    int push_pct;
+    double duration;
+    int latency;
+} opt;
+
+/* Values are (thread id << 40) + sequence number, so every pushed value is
+ * unique. Correctness is checked by comparing count, sum and xor of a hash of
+ * all pushed and popped values, which catches lost and duplicated nodes
+ * without printing or storing them. */
+struct check {
+    long n;
+    uint64_t sum;
+    uint64_t xor;
+};
+
+struct stack_thread {
+    int id;
+    int push_pct;
+    pthread_t thr;
+    void *lnode;
+    struct pool_cache *cache;
+    struct hist *push_lat, *pop_lat;
+    long pushes, pops, empty;
+    struct check pushed, popped;
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct pool node_pool;
+static volatile int start_flag, stop_flag;
+static volatile int nready;
+
+static inline void check_add(struct check *c, uint64_t val) {
+    uint64_t h = mix64(val);
+
+    c->n++;
+    c->sum += h;
+    c->xor ^= h;
+}
+
+static inline Node *node_alloc(struct stack_thread *t) {
+    if (opt.use_pool)
+        return pool_alloc(&node_pool, t->cache);
+    return malloc(sizeof(Node));
+}
+
+static inline void node_free(struct stack_thread *t, Node *n) {
+    if (opt.use_pool)
+        pool_free(t->cache, n);
+}
+
+static inline void do_push(struct stack_thread *t, uint64_t seq) {
+    const struct stack_variant *v = opt.variant;
+    Node *n = node_alloc(t);
+    uint64_t t0 = 0;
+
+    if (n == NULL) {
+        perror("node alloc");
+        exit(EXIT_FAILURE);
+    }
+    n->val = ((uint64_t)t->id << 40) + seq;
+    check_add(&t->pushed, n->val);
+    if (t->push_lat)
+        t0 = rdtsc();
+    v->push(&gstack, n, t->lnode);
+    if (t->push_lat)
+        hist_add(t->push_lat, rdtscp() - t0);
+    t->pushes++;
+}
+
+static inline void do_pop(struct stack_thread *t) {
+    const struct stack_variant *v = opt.variant;
+    uint64_t t0 = 0;
     Node *n;
 
-    while (popcount < NTHR * NITERS) {
-        n = pop(&gstack);
-        if (n) {
-            printf("%d\n", n->val);
-            /* Only one pop thread. */
-            popcount++;
-            /*atomic_inc64(&popcount);*/
-        }
+    if (t->pop_lat)
+        t0 = rdtsc();
+    n = v->pop(&gstack, t->lnode);
+    if (n == NULL) {
+        t->empty++;
+        cpu_relax();
+        return;
     }
+    if (t->pop_lat)
+        hist_add(t->pop_lat, rdtscp() - t0);
+    check_add(&t->popped, n->val);
+    node_free(t, n);
+    t->pops++;
+}
+
+static void *stack_thread(void *arg) {
+    struct stack_thread *t = arg;
+    uint64_t seq = 0, rng = t->id + 1;
 
+    if (opt.use_pool)
+        t->cache = pool_thread_init(&node_pool);
+    if (opt.lock) {
+        t->lnode = calloc(1, opt.lock->node_size);
+        opt.lock->node_init(t->lnode);
+    }
+
+    __sync_fetch_and_add(&nready, 1);
+    while (!start_flag)
+        cpu_relax();
+
+    while (!stop_flag) {
+        if (t->push_pct == 100 ||
+            (t->push_pct && (int)(xorshift64(&rng) % 100) < t->push_pct))
+            do_push(t, seq++);
+        else
+            do_pop(t);
+    }
+
+    if (opt.use_pool)
+        pool_flush(t->cache);
     return NULL;
 }
 
-int main(int argc, const char *argv[]) {
-#ifdef MUTEX
-    pthread_mutex_init(&gstack.mutex, NULL);
-#endif
+static void usage(const char *prog) {
+    printf("Usage: %s [options]\n"
+           "  -v, --variant=NAME      locked, delegated, lockfree, tagged, elimination,\n"
+           "                          percpu or percpu-atomic (default tagged)\n"
+           "  -l, --lock=NAME         lock of the locked and delegated variants (default pthread)\n"
+           "  -P, --producers=N       threads only pushing (default 3)\n"
+           "  -C, --consumers=N       threads only popping (default 1)\n"
+           "  -m, --mixed=N           threads both pushing and popping (default 0)\n"
+           "  -p, --push-pct=P        percentage of pushes of mixed threads (default 50)\n"
+           "  -d, --duration=SEC      run time in seconds (default 1)\n"
+           "  -a, --alloc=pool|malloc node allocator (default pool)\n"
+           "  -L, --latency           report per operation latency percentiles\n",
+           prog);
+}
+
+static int parse_int(const char *s, int min, const char *what) {
+    char *end;
+    long v = strtol(s, &end, 10);
 
-#ifdef SPINLOCK
-    SPIN_LOCK_INIT(&gstack.slock);
-#endif
+    if (*s == '\0' || *end != '\0' || v < min) {
+        fprintf(stderr, "invalid %s: %s\n", what, s);
+        exit(EXIT_FAILURE);
+    }
+    return v;
+}
 
-    /* TODO We need more threads to test the scalability of the stack
-     * implementation.
-     * 
-     * With 3 pusher calling push,
-     * 1. spinlock give worst performance.
-     * 2. mutex is faster than spinlock, but it's running time is not stable.
-     * 3. lock free version is fast, and running time is stable.
-     */
+int main(int argc, char *argv[]) {
+    static const struct option long_opts[] = {
+        { "variant", required_argument, NULL, 'v' },
+        { "lock", required_argument, NULL, 'l' },
+        { "producers", required_argument, NULL, 'P' },
+        { "consumers", required_argument, NULL, 'C' },
+        { "mixed", required_argument, NULL, 'm' },
+        { "push-pct", required_argument, NULL, 'p' },
+        { "duration", required_argument, NULL, 'd' },
+        { "alloc", required_argument, NULL, 'a' },
+        { "latency", no_argument, NULL, 'L' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *lock_name = "pthread";
+    int c;
+
+    opt.variant = &variants[3];
+    opt.use_pool = 1;
+    opt.producers = 3;
+    opt.consumers = 1;
+    opt.push_pct = 50;
+    opt.duration = 1;
+
+    /* With LOCKSTAT, SIGUSR1 prints the lock report. */
+    lockstat_report_on_signal(SIGUSR1);
+
+    while ((c = getopt_long(argc, argv, "v:l:P:C:m:p:d:a:Lh", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'v':
+            opt.variant = NULL;
+            for (unsigned i = 0; i < NVARIANTS; i++) {
+                if (strcmp(variants[i].name, optarg) == 0)
+                    opt.variant = &variants[i];
+            }
+            if (!opt.variant) {
+                fprintf(stderr, "unknown variant: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'l':
+            lock_name = optarg;
+            break;
+        case 'P':
+            opt.producers = parse_int(optarg, 0, "producers");
+            break;
+        case 'C':
+            opt.consumers = parse_int(optarg, 0, "consumers");
+            break;
+        case 'm':
+            opt.mixed = parse_int(optarg, 0, "mixed");
+            break;
+        case 'p':
+            opt.push_pct = parse_int(optarg, 0, "push-pct");
+            if (opt.push_pct > 100) {
+                fprintf(stderr, "push-pct must be at most 100\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd':
+            opt.duration = atof(optarg);
+            if (opt.duration <= 0) {
+                fprintf(stderr, "invalid duration: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'a':
+            if (strcmp(optarg, "pool") == 0) {
+                opt.use_pool = 1;
+            } else if (strcmp(optarg, "malloc") == 0) {
+                opt.use_pool = 0;
+            } else {
+                fprintf(stderr, "unknown allocator: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            opt.latency = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    pthread_t thr_push[NTHR], thr_pop;
-    long i;
+    int nthr = opt.producers + opt.consumers + opt.mixed;
+    int poppers = opt.consumers + (opt.push_pct < 100 ? opt.mixed : 0);
 
-    for (i = 0; i < NTHR; i++) {
-        if (pthread_create(&thr_push[i], NULL, pusher, (void *)i) != 0) {
-            perror("thread creating failed");
+    if (nthr == 0) {
+        fprintf(stderr, "need at least one thread\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opt.variant->single_popper && poppers > 1) {
+        fprintf(stderr, "%s stack supports only one popping thread\n",
+                opt.variant->name);
+        exit(EXIT_FAILURE);
+    }
+    if (opt.variant->uses_lock) {
+        opt.lock = bench_find_lock(lock_name);
+        if (!opt.lock) {
+            fprintf(stderr, "unknown lock: %s\n", lock_name);
+            exit(EXIT_FAILURE);
+        }
+        if (!opt.lock->acquire) {
+            fprintf(stderr, "%s is not a lock\n", lock_name);
+            exit(EXIT_FAILURE);
         }
+        if (opt.lock->supported && !opt.lock->supported()) {
+            fprintf(stderr, "lock %s not supported on this CPU\n", lock_name);
+            exit(EXIT_FAILURE);
+        }
+        if (opt.lock->max_threads && nthr > opt.lock->max_threads) {
+            fprintf(stderr, "lock %s supports at most %d threads\n",
+                    lock_name, opt.lock->max_threads);
+            exit(EXIT_FAILURE);
+        }
+        if (posix_memalign(&gstack.l, CACHE_LINE, opt.lock->lock_size) != 0) {
+            perror("posix_memalign");
+            exit(EXIT_FAILURE);
+        }
+        gstack.lock = opt.lock;
+        opt.lock->lock_init(gstack.l);
+    }
+    if (opt.variant->percpu &&
+        percpu_stack_init(&gstack.pcpu, opt.variant->percpu_flags) != 0) {
+        perror("percpu_stack_init");
+        exit(EXIT_FAILURE);
     }
+    if (opt.use_pool && pool_init(&node_pool, sizeof(Node)) != 0) {
+        fprintf(stderr, "node too large for pool\n");
+        exit(EXIT_FAILURE);
+    }
+
+    double tsc_per_ns = tsc_calibrate();
+    struct stack_thread *thr;
 
-    if (pthread_create(&thr_pop, NULL, poper, NULL) != 0) {
-        perror("thread creating failed");
+    if (posix_memalign((void **)&thr, CACHE_LINE, nthr * sizeof(*thr)) != 0) {
+        perror("posix_memalign");
+        exit(EXIT_FAILURE);
+    }
+    memset(thr, 0, nthr * sizeof(*thr));
+
+    for (int i = 0; i < nthr; i++) {
+        struct stack_thread *t = &thr[i];
+
+        t->id = i;
+        if (i < opt.producers)
+            t->push_pct = 100;
+        else if (i < opt.producers + opt.consumers)
+            t->push_pct = 0;
+        else
+            t->push_pct = opt.push_pct;
+        if (opt.latency) {
+            t->push_lat = hist_new();
+            t->pop_lat = hist_new();
+        }
+        if (pthread_create(&t->thr, NULL, stack_thread, t) != 0) {
+            perror("thread creating failed");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    for (i = 0; i < NTHR; i++) {
-        pthread_join(thr_push[i], NULL);
+    struct timespec start, end, run;
+
+    while (nready < nthr)
+        cpu_relax();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    start_flag = 1;
+    run.tv_sec = (time_t)opt.duration;
+    run.tv_nsec = (long)((opt.duration - run.tv_sec) * 1e9);
+    nanosleep(&run, NULL);
+    stop_flag = 1;
+    for (int i = 0; i < nthr; i++)
+        pthread_join(thr[i].thr, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* Sum up per thread results and check against what's popped, including
+     * nodes left on the stack. The main thread drains the stack with its own
+     * lock node, all workers are done. */
+    struct check pushed = { 0 }, popped = { 0 };
+    long pushes = 0, pops = 0, empty = 0;
+    struct hist *push_lat = NULL, *pop_lat = NULL;
+    void *lnode = NULL;
+    Node *n;
+
+    if (opt.latency) {
+        push_lat = hist_new();
+        pop_lat = hist_new();
+    }
+    for (int i = 0; i < nthr; i++) {
+        struct stack_thread *t = &thr[i];
+
+        pushes += t->pushes;
+        pops += t->pops;
+        empty += t->empty;
+        pushed.n += t->pushed.n;
+        pushed.sum += t->pushed.sum;
+        pushed.xor ^= t->pushed.xor;
+        popped.n += t->popped.n;
+        popped.sum += t->popped.sum;
+        popped.xor ^= t->popped.xor;
+        if (opt.latency) {
+            hist_merge(push_lat, t->push_lat);
+            hist_merge(pop_lat, t->pop_lat);
+        }
+    }
+    if (opt.lock) {
+        lnode = calloc(1, opt.lock->node_size);
+        opt.lock->node_init(lnode);
     }
-    pthread_join(thr_pop, NULL);
+    if (opt.variant->percpu) {
+        /* Pop only reaches the main thread's CPU. */
+        for (int i = 0; i < gstack.pcpu.ncpus; i++) {
+            for (n = percpu_stack_drain(&gstack.pcpu, i); n; n = n->next)
+                check_add(&popped, n->val);
+        }
+    }
+    while ((n = opt.variant->pop(&gstack, lnode)) != NULL)
+        check_add(&popped, n->val);
+
+    double secs = calc_time(&start, &end);
+    long ops = pushes + pops + empty;
+
+    printf("variant,lock,alloc,producers,consumers,mixed,push_pct,secs,"
+           "pushes,pops,empty_pops,mops_per_s,ns_per_op");
+    if (opt.latency)
+        printf(",push_p50_ns,push_p99_ns,push_p999_ns,pop_p50_ns,pop_p99_ns,pop_p999_ns");
+    if (opt.lock && opt.lock->stats)
+        printf(",lock_stats");
+    printf("\n%s,%s,%s,%d,%d,%d,%d,%.3f,%ld,%ld,%ld,%.3f,%.1f",
+           opt.variant->name, opt.lock ? opt.lock->name : "-",
+           opt.use_pool ? "pool" : "malloc", opt.producers, opt.consumers,
+           opt.mixed, opt.push_pct, secs, pushes, pops, empty,
+           (pushes + pops) / secs / 1e6, ops ? secs * nthr * 1e9 / ops : 0);
+    if (opt.latency) {
+        struct hist *h[] = { push_lat, pop_lat };
+
+        for (int i = 0; i < 2; i++) {
+            printf(",%.1f,%.1f,%.1f", hist_quantile(h[i], 0.5) / tsc_per_ns,
+                   hist_quantile(h[i], 0.99) / tsc_per_ns,
+                   hist_quantile(h[i], 0.999) / tsc_per_ns);
+        }
+    }
+    if (opt.lock && opt.lock->stats) {
+        char buf[256];
 
+        opt.lock->stats(gstack.l, buf, sizeof(buf));
+        printf(",%s", buf);
+    }
+    printf("\n");
+
+    if (pushed.n != popped.n || pushed.sum != popped.sum ||
+        pushed.xor != popped.xor) {
+        fprintf(stderr, "FAIL: pushed %ld nodes, popped %ld, checksum %s\n",
+                pushed.n, popped.n,
+                pushed.sum == popped.sum && pushed.xor == popped.xor ?
+                "ok" : "mismatch");
+        return 1;
+    }
     return 0;
 }
-
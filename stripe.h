@@ -0,0 +1,91 @@
+#ifndef _STRIPE_H
+#define _STRIPE_H
+
+/* Lock striping: an array of locks of any implementation in the lock table
+ * (bench.h), each starting on its own cache line, picked by a hash.
+ *
+ * The stripe count is a power of two and the stripe is the low bits of the
+ * hash. A table with more buckets than stripes should pass the bucket index
+ * as hash, then every bucket is always covered by the same stripe.
+ *
+ * Queue locks need a node per acquisition. A thread holding at most one
+ * stripe at a time can use a single node, from stripe_node_new, for all of
+ * them. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "bench.h"
+
+struct stripes {
+    const struct bench_lock *impl;
+    char *locks;
+    size_t stride; /* lock_size rounded up to whole cache lines. */
+    unsigned mask; /* Stripe count - 1. */
+};
+
+/* Return -1 if n is not a power of two or memory is short. */
+static inline int stripes_init(struct stripes *s, const struct bench_lock *impl,
+        unsigned n)
+{
+    if (n == 0 || (n & (n - 1)))
+        return -1;
+    s->impl = impl;
+    s->mask = n - 1;
+    s->stride = (impl->lock_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    if (posix_memalign((void **)&s->locks, CACHE_LINE, s->stride * n) != 0)
+        return -1;
+    memset(s->locks, 0, s->stride * n);
+    for (unsigned i = 0; i < n; i++)
+        impl->lock_init(s->locks + i * s->stride);
+    return 0;
+}
+
+static inline void stripes_destroy(struct stripes *s)
+{
+    free(s->locks);
+    s->locks = NULL;
+}
+
+static inline unsigned stripe_index(const struct stripes *s, uint64_t hash)
+{
+    return hash & s->mask;
+}
+
+static inline void *stripe_lock(const struct stripes *s, uint64_t hash)
+{
+    return s->locks + stripe_index(s, hash) * s->stride;
+}
+
+/* Queue node for this thread, free with free(). */
+static inline void *stripe_node_new(const struct stripes *s)
+{
+    void *n = calloc(1, s->impl->node_size);
+
+    if (n)
+        s->impl->node_init(n);
+    return n;
+}
+
+static inline void stripe_acquire(const struct stripes *s, uint64_t hash, void *node)
+{
+    s->impl->acquire(stripe_lock(s, hash), node);
+}
+
+static inline void stripe_release(const struct stripes *s, uint64_t hash, void *node)
+{
+    s->impl->release(stripe_lock(s, hash), node);
+}
+
+/* Shared acquisition, exclusive for locks which are not reader-writer. */
+static inline void stripe_acquire_read(const struct stripes *s, uint64_t hash, void *node)
+{
+    s->impl->acquire_read(stripe_lock(s, hash), node);
+}
+
+static inline void stripe_release_read(const struct stripes *s, uint64_t hash, void *node)
+{
+    s->impl->release_read(stripe_lock(s, hash), node);
+}
+
+#endif /* _STRIPE_H */
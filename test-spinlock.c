@@ -1,40 +1,159 @@
 #define _GNU_SOURCE
 #include <pthread.h>
-#include <sched.h>
-#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
-#include <sys/time.h>
-#include <errno.h>
+#include "bench.h"
+#include "hist.h"
+#include "tsc.h"
+#include "backoff.h"
+#include "lockstat.h"
+#include "work.h"
+
+/* This file is compiled once for each lock implementation, see Makefile. The
+ * resulting object exports a struct bench_lock named bench_lock_<LOCK_ID>
+ * which is registered in locks.c.
+ *
+ * To add a new lock, add a branch below which includes the header and maps
+ * the lock to lock_t, lock_acquire and lock_release, then add it to Makefile
+ * and the lock table in locks.c. Defining ELIDE in the branch wraps the lock
+ * with RTM lock elision (elision.h), the adapter must then also define
+ * lock_is_locked. */
+
+/* Each lock is built twice. The lock headers only define cpu_relax when it
+ * isn't defined yet, so with LOCK_BACKOFF every spin loop waits as set by the
+ * backoff policy (backoff.h), and the object exports bench_lock_<LOCK_ID>_bo.
+ * Locks knowing their queue position pass it with cpu_relax_dist, and
+ * backoff_start begins a new wait episode, before each acquire and each
+ * release so waits for a successor in unlock start from the shortest pause.
+ * The plain object keeps each lock's own pause loop. */
+#ifdef LOCK_BACKOFF
+static __thread struct backoff backoff_self;
+#define cpu_relax() backoff_pause(&backoff_self)
+#define cpu_relax_dist(d) backoff_pause_dist(&backoff_self, (d))
+#define backoff_start() backoff_init(&backoff_self)
+#else
+#define backoff_start() ((void)0)
+#endif
 
 #ifdef XCHG
 #include "spinlock-xchg.h"
+#define LOCK_NAME "xchg"
+#define LOCK_ID xchg
 #elif defined(XCHGBACKOFF)
 #include "spinlock-xchg-backoff.h"
+#define LOCK_NAME "xchg-backoff"
+#define LOCK_ID xchg_backoff
 #elif defined(K42)
 #include "spinlock-k42.h"
+#define LOCK_NAME "k42"
+#define LOCK_ID k42
 #elif defined(MCS)
 #include "spinlock-mcs.h"
+#define LOCK_NAME "mcs"
+#define LOCK_ID mcs
 #elif defined(TICKET)
 #include "spinlock-ticket.h"
+#define LOCK_NAME "ticket"
+#define LOCK_ID ticket
 #elif defined(PTHREAD)
 #include "spinlock-pthread.h"
+#define LOCK_NAME "pthread"
+#define LOCK_ID pthread
 #elif defined(CMPXCHG)
 #include "spinlock-cmpxchg.h"
+#define LOCK_NAME "cmpxchg"
+#define LOCK_ID cmpxchg
 #elif defined(RTM)
 #include "spinlock-xchg.h"
-#include "rtm.h"
+#define ELIDE
+#define LOCK_NAME "rtm"
+#define LOCK_ID rtm
+#elif defined(RTMTICKET)
+#include "spinlock-ticket.h"
+#define ELIDE
+#define LOCK_NAME "rtm-ticket"
+#define LOCK_ID rtm_ticket
+#elif defined(RTMMCS)
+#include "spinlock-mcs.h"
+#define ELIDE
+#define LOCK_NAME "rtm-mcs"
+#define LOCK_ID rtm_mcs
+#elif defined(RTMFUTEX)
+#include "spinlock-futex.h"
+#define ELIDE
+#define LOCK_NAME "rtm-futex"
+#define LOCK_ID rtm_futex
 #elif defined(HLE)
 #include "spinlock-xchg-hle.h"
+#define LOCK_NAME "hle"
+#define LOCK_ID hle
+#elif defined(CLH)
+#include "spinlock-clh.h"
+#define LOCK_NAME "clh"
+#define LOCK_ID clh
+#elif defined(CLHPADDED)
+#define CLH_PADDED
+#include "spinlock-clh.h"
+#define LOCK_NAME "clh-padded"
+#define LOCK_ID clh_padded
+#elif defined(FUTEX)
+#include "spinlock-futex.h"
+#define LOCK_NAME "futex"
+#define LOCK_ID futex
+#elif defined(ANDERSON)
+#include "spinlock-anderson.h"
+#define LOCK_NAME "anderson"
+#define LOCK_ID anderson
+#elif defined(PTICKET)
+#include "spinlock-partitioned-ticket.h"
+#define LOCK_NAME "ticket-partitioned"
+#define LOCK_ID ticket_partitioned
+#elif defined(TICKETBO)
+#include "spinlock-ticket-backoff.h"
+#define LOCK_NAME "ticket-backoff"
+#define LOCK_ID ticket_backoff
+#elif defined(RWCOUNTER)
+#include "rwlock-counter.h"
+#define LOCK_NAME "rw-counter"
+#define LOCK_ID rw_counter
+#elif defined(RWTICKET)
+#include "rwlock-ticket.h"
+#define LOCK_NAME "rw-ticket"
+#define LOCK_ID rw_ticket
+#elif defined(RWPHASEFAIR)
+#include "rwlock-phasefair.h"
+#define LOCK_NAME "rw-phasefair"
+#define LOCK_ID rw_phasefair
+#elif defined(RWPERCPU)
+#include "rwlock-percpu.h"
+#define LOCK_NAME "rw-percpu"
+#define LOCK_ID rw_percpu
+#elif defined(COHORT)
+#include "spinlock-cohort.h"
+#define LOCK_NAME "cohort"
+#define LOCK_ID cohort
+#elif defined(REACTIVE)
+#include "spinlock-reactive.h"
+#define LOCK_NAME "reactive"
+#define LOCK_ID reactive
+#elif defined(QSPINLOCK)
+#include "spinlock-qspinlock.h"
+#define LOCK_NAME "qspinlock"
+#define LOCK_ID qspinlock
+#elif defined(CLHTIMEOUT)
+#include "spinlock-clh-timeout.h"
+#define LOCK_NAME "clh-timeout"
+#define LOCK_ID clh_timeout
+#elif defined(FC)
+#include "spinlock-fc.h"
+#define LOCK_NAME "fc"
+#define LOCK_ID fc
 #else
 #error "must define a spinlock implementation"
 #endif
 
-#ifndef cpu_relax
-#define cpu_relax() asm volatile("pause\n": : :"memory")
-#endif
-
 /* It's hard to say which spinlock implementation performs best. I guess the
  * performance depends on CPU topology which will affect the cache coherence
  * messages, and maybe other factors.
@@ -65,162 +184,603 @@
  * - Ticket spinlock actually performs very badly.
  */
 
-/* Number of total lock/unlock pair.
- * Note we need to ensure the total pair of lock and unlock opeartion are the
- * same no matter how many threads are used. */
-#define N_PAIR 16000000
+/* Map each implementation to a common interface. lock_node_t is the per
+ * thread queue node needed by MCS, other locks ignore it. Reader-writer locks
+ * also define lock_acquire_read and lock_release_read, for the others a read
+ * takes the lock exclusively. */
+#if defined(MCS) || defined(RTMMCS)
 
-/* Bind threads to specific cores. The goal is to make threads locate on the
- * same physical CPU. Modify bind_core before using this. */
-//#define BIND_CORE
+typedef mcs_lock lock_t;
+typedef mcs_lock_t lock_node_t;
+#define lock_acquire(l, n) lock_mcs((l), (n))
+#define lock_release(l, n) unlock_mcs((l), (n))
+#define lock_is_locked(l) (*(l) != NULL)
 
-static int nthr = 0;
+#elif defined(CLH) || defined(CLHPADDED)
 
-static volatile uint32_t wflag;
-/* Wait on a flag to make all threads start almost at the same time. */
-void wait_flag(volatile uint32_t *flag, uint32_t expect) {
-    __sync_fetch_and_add((uint32_t *)flag, 1);
-    while (*flag != expect) {
-        cpu_relax();
+typedef clhlock lock_t;
+typedef clh_node *lock_node_t;
+#define lock_acquire(l, n) clh_lock((l), (n))
+#define lock_release(l, n) clh_unlock((l), (n))
+
+/* CLH nodes move between threads, so they can't live on a thread's stack.
+ * Take them from a pool which is reset with the lock before each run, runs
+ * with more threads than the pool leak the extra nodes. */
+#define CLH_POOL 4096
+static clh_node clh_pool[CLH_POOL];
+static int clh_pool_used;
+
+static void lock_node_init(lock_node_t *n)
+{
+    int i = __sync_fetch_and_add(&clh_pool_used, 1);
+
+    if (i < CLH_POOL) {
+        *n = &clh_pool[i];
+    } else if (posix_memalign((void **)n, 64, sizeof(clh_node)) != 0) {
+        perror("posix_memalign");
+        exit(EXIT_FAILURE);
     }
 }
+#define lock_node_init lock_node_init
+#define lock_init_extra() (clh_pool_used = 0)
 
-static struct timeval start_time;
-static struct timeval end_time;
+#elif defined(FUTEX) || defined(RTMFUTEX)
 
-static void calc_time(struct timeval *start, struct timeval *end) {
-    if (end->tv_usec < start->tv_usec) {
-        end->tv_sec -= 1;
-        end->tv_usec += 1000000;
-    }
+typedef futexlock lock_t;
+typedef int lock_node_t;
+#define lock_acquire(l, n) ((void)(n), futex_lock(l))
+#define lock_release(l, n) ((void)(n), futex_unlock(l))
+#define lock_is_locked(l) ((l)->state != 0)
+
+#elif defined(ANDERSON)
+
+typedef andersonlock lock_t;
+typedef int lock_node_t;
+#define lock_acquire(l, n) ((void)(n), anderson_lock(l))
+#define lock_release(l, n) ((void)(n), anderson_unlock(l))
+#define lock_setup(l) anderson_init(l)
+#define LOCK_MAX_THREADS ANDERSON_SLOTS
+
+#elif defined(PTICKET)
 
-    assert(end->tv_sec >= start->tv_sec);
-    assert(end->tv_usec >= start->tv_usec);
-    struct timeval interval = {
-        end->tv_sec - start->tv_sec,
-        end->tv_usec - start->tv_usec
-    };
-    printf("%ld.%06ld\t", (long)interval.tv_sec, (long)interval.tv_usec);
+typedef pticketlock lock_t;
+typedef int lock_node_t;
+#define lock_acquire(l, n) ((void)(n), pticket_lock(l))
+#define lock_release(l, n) ((void)(n), pticket_unlock(l))
+
+#elif defined(TICKETBO)
+
+typedef ticketbolock lock_t;
+typedef int lock_node_t;
+#define lock_acquire(l, n) ((void)(n), ticketbo_lock(l))
+#define lock_release(l, n) ((void)(n), ticketbo_unlock(l))
+
+#elif defined(REACTIVE)
+
+typedef reactivelock lock_t;
+typedef int lock_node_t;
+#define lock_acquire(l, n) ((void)(n), reactive_lock(l))
+#define lock_release(l, n) ((void)(n), reactive_unlock(l))
+
+static lock_t lock;
+
+static void lock_stats(void *l, char *buf, size_t len) {
+    lock_t *r = l ? l : &lock;
+
+    snprintf(buf, len, "switches=%lu mode=%s", r->switches,
+             r->mode == REACTIVE_TAS ? "tas" : "queue");
 }
+#define LOCK_STATS lock_stats
+
+#elif defined(QSPINLOCK)
+
+typedef qspinlock lock_t;
+typedef int lock_node_t;
+#define lock_acquire(l, n) ((void)(n), qspin_lock(l))
+#define lock_release(l, n) ((void)(n), qspin_unlock(l))
 
-// Use an array of counter to see effect on RTM if touches more cache line.
-#define NCOUNTER 1
-#define CACHE_LINE 64
+#elif defined(CLHTIMEOUT)
 
-// Use thread local counter to avoid cache contention between cores.
-// For TSX, this avoids TX conflicts so the performance overhead/improvement is
-// due to TSX mechanism.
-static __thread int8_t counter[CACHE_LINE*NCOUNTER];
+typedef clhtolock lock_t;
+typedef int lock_node_t;
+#define lock_acquire(l, n) ((void)(n), clhto_lock(l))
+#define lock_release(l, n) ((void)(n), clhto_unlock(l))
+#define lock_acquire_timeout(l, n, ns) ((void)(n), clhto_lock_timeout((l), (ns)))
+#define lock_init_extra() clhto_setup()
 
-#ifdef MCS
-mcs_lock cnt_lock = NULL;
+#elif defined(FC)
+
+typedef fclock lock_t;
+typedef int lock_node_t;
+#define lock_acquire(l, n) ((void)(n), fc_lock(l))
+#define lock_release(l, n) ((void)(n), fc_unlock(l))
+#define lock_execute(l, n, fn, arg) ((void)(n), fc_execute((l), (fn), (arg)))
+#define LOCK_MAX_THREADS FC_MAX_THREADS
+
+static lock_t lock;
+
+static void lock_stats(void *l, char *buf, size_t len) {
+    lock_t *f = l ? l : &lock;
+
+    snprintf(buf, len, "sessions=%lu served_per_session=%.2f", f->sessions,
+             f->sessions ? (double)f->served / f->sessions : 0);
+}
+#define LOCK_STATS lock_stats
+
+#elif defined(RWCOUNTER) || defined(RWTICKET) || defined(RWPHASEFAIR) || defined(RWPERCPU)
+
+#if defined(RWCOUNTER)
+typedef rwcounter lock_t;
+#define RW_PREFIX(f) rwcounter_##f
+#elif defined(RWTICKET)
+typedef rwticket lock_t;
+#define RW_PREFIX(f) rwticket_##f
+#elif defined(RWPHASEFAIR)
+typedef rwphasefair lock_t;
+#define RW_PREFIX(f) rwphasefair_##f
 #else
-spinlock sl;
+typedef rwpercpu lock_t;
+#define RW_PREFIX(f) rwpercpu_##f
 #endif
+typedef int lock_node_t;
+#define lock_acquire(l, n) ((void)(n), RW_PREFIX(write_lock)(l))
+#define lock_release(l, n) ((void)(n), RW_PREFIX(write_unlock)(l))
+#define lock_acquire_read(l, n) ((void)(n), RW_PREFIX(read_lock)(l))
+#define lock_release_read(l, n) ((void)(n), RW_PREFIX(read_unlock)(l))
 
-#ifdef BIND_CORE
-void bind_core(int threadid) {
-    /* cores with logical id 4x   is on CPU physical id 0 */
-    /* cores with logical id 4x+1 is on CPU physical id 1 */
-    int phys_id = threadid / 10;
-    int core = threadid % 10;
+#elif defined(COHORT)
 
-    int logical_id = 4 * core + phys_id;
-    /*printf("thread %d bind to logical core %d on physical id %d\n", threadid, logical_id, phys_id);*/
+typedef cohortlock lock_t;
+typedef mcs_lock_t lock_node_t;
+#define lock_acquire(l, n) cohort_lock((l), (n))
+#define lock_release(l, n) cohort_unlock((l), (n))
 
-    cpu_set_t set;
-    CPU_ZERO(&set);
-    CPU_SET(logical_id, &set);
+#else
 
-    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
-        perror("Set affinity failed");
-        exit(EXIT_FAILURE);
+typedef spinlock lock_t;
+typedef int lock_node_t;
+#define lock_acquire(l, n) ((void)(n), spin_lock(l))
+#define lock_release(l, n) ((void)(n), spin_unlock(l))
+#if defined(RTM)
+#define lock_is_locked(l) (*(l) != 0)
+#elif defined(RTMTICKET)
+#define lock_is_locked(l) ((l)->s.ticket != (l)->s.users)
+#endif
+
+#endif
+
+#ifndef LOCK_SUPPORTED
+#define LOCK_SUPPORTED NULL
+#endif
+#ifndef LOCK_MAX_THREADS
+#define LOCK_MAX_THREADS 0
+#endif
+
+#ifndef lock_acquire_read
+#define lock_acquire_read lock_acquire
+#define lock_release_read lock_release
+#endif
+
+/* Locks with a timed acquire define lock_acquire_timeout, returning non
+ * zero on timeout. */
+#ifdef lock_acquire_timeout
+#define LOCK_TIMEOUT 1
+#else
+#define LOCK_TIMEOUT 0
+#define lock_acquire_timeout(l, n, ns) ((void)(ns), lock_acquire((l), (n)), 0)
+#endif
+
+#ifndef lock_node_init
+#define lock_node_init(n) ((void)(n))
+#endif
+
+#ifdef ELIDE
+#include "elision.h"
+
+/* Wrap the lock mapped above: lock_t becomes the plain lock plus its
+ * elision state and acquire/release go through elision.h. */
+static int plain_is_locked(void *l) {
+    return lock_is_locked((lock_t *)l);
+}
+
+static void plain_acquire(void *l, void *n) {
+    lock_acquire((lock_t *)l, (lock_node_t *)n);
+}
+
+static void plain_release(void *l, void *n) {
+    lock_release((lock_t *)l, (lock_node_t *)n);
+}
+
+typedef struct {
+    lock_t plain;
+    struct elision e;
+} elided_lock_t;
+#define lock_t elided_lock_t
+
+#undef lock_acquire
+#undef lock_release
+#define lock_acquire(l, n) \
+    elision_lock(&(l)->e, &(l)->plain, (n), plain_is_locked, plain_acquire)
+#define lock_release(l, n) \
+    elision_unlock(&(l)->e, &(l)->plain, (n), plain_release)
+
+#define lock_init_extra() elision_stats_reset()
+
+/* Elision counters are per object, they cover every elided lock. */
+static void lock_stats(void *l, char *buf, size_t len) {
+    struct elision_stats s;
+
+    if (!elision_available()) {
+        snprintf(buf, len, "rtm=unavailable");
+        return;
     }
+    elision_stats_sum(&s);
+    snprintf(buf, len, "commits=%lu busy=%lu conflict=%lu capacity=%lu "
+             "retry=%lu other=%lu fallbacks=%lu skipped=%lu",
+             s.commits, s.busy, s.conflict, s.capacity, s.retry, s.other,
+             s.fallbacks, s.skipped);
 }
+#define LOCK_STATS lock_stats
 #endif
 
-void *inc_thread(void *id) {
-    int n = N_PAIR / nthr;
-    assert(n * nthr == N_PAIR);
-#ifdef MCS
-    mcs_lock_t local_lock;
+#ifndef LOCK_STATS
+#define LOCK_STATS NULL
 #endif
-#ifdef BIND_CORE
-    bind_core((int)(long)(id));
+
+/* Recording a lock writes shared memory and calls getcpu, which would abort
+ * every elided section. Lockstat only sees acquisitions taking the lock. */
+#if defined(LOCKSTAT) && defined(ELIDE)
+#define lockstat_skip() elision_active()
+#else
+#define lockstat_skip() 0
 #endif
-    wait_flag(&wflag, nthr);
+static inline void stat_acquired(const void *l, uint64_t t0) {
+    if (!lockstat_skip())
+        lockstat_acquired(l, t0);
+}
 
-    if (((long) id == 0)) {
-        /*printf("get start time\n");*/
-        gettimeofday(&start_time, NULL);
-    }
+static inline void stat_released(const void *l) {
+    if (!lockstat_skip())
+        lockstat_released(l);
+}
+#ifndef lock_init_extra
+#define lock_init_extra() ((void)0)
+#endif
 
-    /* Start lock unlock test. */
-    for (int i = 0; i < n; i++) {
-#ifdef MCS
-        lock_mcs(&cnt_lock, &local_lock);
-        for (int j = 0; j < NCOUNTER; j++) counter[j*CACHE_LINE]++;
-        unlock_mcs(&cnt_lock, &local_lock);
-#elif RTM
-        int status;
-        if ((status = _xbegin()) == _XBEGIN_STARTED) {
-            for (int j = 0; j < NCOUNTER; j++) counter[j*CACHE_LINE]++;
-            if (sl == BUSY)
-                _xabort(1);
-            _xend();
-        } else {
-            spin_lock(&sl);
-            for (int j = 0; j < NCOUNTER; j++) counter[j*CACHE_LINE]++;
-            spin_unlock(&sl);
-        }
+/* Delegating locks define lock_execute, running fn(arg) under the lock,
+ * possibly on another thread, and returning its result. The counter benchmark
+ * then hands its critical section to the lock. */
+#ifdef lock_execute
+#define LOCK_DELEGATE 1
 #else
-        spin_lock(&sl);
-        for (int j = 0; j < NCOUNTER; j++) counter[j*CACHE_LINE]++;
-        spin_unlock(&sl);
+#define LOCK_DELEGATE 0
+static inline void *lock_execute_plain(lock_t *l, lock_node_t *n,
+        void *(*fn)(void *), void *arg) {
+    void *ret;
+
+    lock_acquire(l, n);
+    ret = fn(arg);
+    lock_release(l, n);
+    return ret;
+}
+#define lock_execute lock_execute_plain
 #endif
+
+/* Most locks are unlocked when filled with zero, the others define
+ * lock_setup. */
+#ifndef lock_setup
+#define lock_setup(l) memset((l), 0, sizeof(lock_t))
+#endif
+
+static lock_t lock;
+
+/* Reset the lock of the counter benchmark. lock_init_extra resets state
+ * shared by all locks of this type. */
+static void lock_init(void) {
+    lock_setup(&lock);
+    lock_init_extra();
+    lockstat_name(&lock, LOCK_NAME);
+}
+
+/* Generic interface, see struct bench_lock. */
+static void generic_lock_init(void *l) {
+    lock_setup((lock_t *)l);
+    lockstat_name(l, LOCK_NAME);
+}
+
+static void generic_node_init(void *n) {
+    lock_node_init((lock_node_t *)n);
+}
+
+static void generic_acquire(void *l, void *n) {
+    uint64_t t0 = lockstat_start();
+
+    backoff_start();
+    lock_acquire((lock_t *)l, (lock_node_t *)n);
+    stat_acquired(l, t0);
+}
+
+static void generic_release(void *l, void *n) {
+    stat_released(l);
+    backoff_start();
+    lock_release((lock_t *)l, (lock_node_t *)n);
+}
+
+/* With lockstat, the whole call counts as wait time. */
+static void *generic_execute(void *l, void *n, void *(*fn)(void *), void *arg) {
+    uint64_t t0 = lockstat_start();
+    void *ret;
+
+    backoff_start();
+    ret = lock_execute((lock_t *)l, (lock_node_t *)n, fn, arg);
+    lockstat_acquired(l, t0);
+    lockstat_released(l);
+    return ret;
+}
+
+static void generic_acquire_read(void *l, void *n) {
+    uint64_t t0 = lockstat_start();
+
+    backoff_start();
+    lock_acquire_read((lock_t *)l, (lock_node_t *)n);
+    stat_acquired(l, t0);
+}
+
+static void generic_release_read(void *l, void *n) {
+    stat_released(l);
+    backoff_start();
+    lock_release_read((lock_t *)l, (lock_node_t *)n);
+}
+
+/* The critical section touches one byte in each of work->cs_lines cache
+ * lines of t->data. With thread local data there is no cache contention
+ * between cores besides the lock itself. For TSX, this avoids TX conflicts so
+ * the performance overhead/improvement is due to TSX mechanism. Read
+ * operations only load the data. */
+static inline void critical_section(struct bench_thread *t, int rd) {
+    volatile int8_t *p = t->data;
+    int n = t->work->cs_lines;
+
+    if (t->work->cs_write && !rd) {
+        for (int j = 0; j < n; j++) p[j*CACHE_LINE]++;
+    } else {
+        for (int j = 0; j < n; j++) (void)p[j*CACHE_LINE];
     }
+}
+
+/* Whether the next operation takes the lock for reading. */
+static inline int read_op(struct bench_thread *t, uint64_t *rng) {
+    return t->work->read_pct && (int)(xorshift64(rng) % 100) < t->work->read_pct;
+}
+
+static inline void acquire(int rd, lock_node_t *node) {
+    uint64_t t0 = lockstat_start();
+
+    backoff_start();
+    if (rd)
+        lock_acquire_read(&lock, node);
+    else
+        lock_acquire(&lock, node);
+    stat_acquired(&lock, t0);
+}
+
+/* Exclusive acquire giving up after ns, return 0 on timeout. */
+static inline int acquire_timeout(lock_node_t *node, uint64_t ns) {
+    uint64_t t0 = lockstat_start();
+
+    backoff_start();
+    if (lock_acquire_timeout(&lock, node, ns))
+        return 0;
+    stat_acquired(&lock, t0);
+    return 1;
+}
+
+/* Whether the next exclusive operation uses a timed acquire. */
+static inline int timed_op(struct bench_thread *t, uint64_t *rng) {
+    return t->work->timeout_pct &&
+        (int)(xorshift64(rng) % 100) < t->work->timeout_pct;
+}
 
-    if (__sync_fetch_and_add((uint32_t *)&wflag, -1) == 1) {
-        /*printf("get end time\n");*/
-        gettimeofday(&end_time, NULL);
+static inline void release(int rd, lock_node_t *node) {
+    stat_released(&lock);
+    backoff_start();
+    if (rd)
+        lock_release_read(&lock, node);
+    else
+        lock_release(&lock, node);
+}
+
+/* Count consecutive exclusive acquisitions by the same thread, called in the
+ * critical section. */
+static inline void fair_update(struct bench_thread *t) {
+    struct bench_fair *f = t->fair;
+
+    if (f->owner == t->id) {
+        f->streak++;
+    } else {
+        f->owner = t->id;
+        f->streak = 1;
     }
+    if (f->streak > f->max_streak)
+        f->max_streak = f->streak;
+}
+
+#if LOCK_DELEGATE
+struct delegate_req {
+    struct bench_thread *t;
+    int rd;
+    int fair; /* Track fairness of exclusive operations. */
+};
+
+static void *delegated_section(void *arg) {
+    struct delegate_req *r = arg;
+
+    if (r->fair && !r->rd)
+        fair_update(r->t);
+    critical_section(r->t, r->rd);
     return NULL;
 }
 
-int main(int argc, const char *argv[])
-{
-    pthread_t *thr;
-    int ret = 0;
+/* Hand the critical section to the lock, it may run on another thread.
+ * Waiting and running it can't be told apart, callers count both as acquire
+ * time. */
+static inline void delegate(struct bench_thread *t, int rd, lock_node_t *node,
+        int fair) {
+    struct delegate_req r = { t, rd, fair };
+    uint64_t t0 = lockstat_start();
+
+    backoff_start();
+    lock_execute(&lock, node, delegated_section, &r);
+    lockstat_acquired(&lock, t0);
+    lockstat_released(&lock);
+}
+#endif
+
+/* Same loop as below, but timestamps every operation. Kept separate so the
+ * plain loop has no extra instructions. */
+static void inc_latency(struct bench_thread *t, lock_node_t *node) {
+    long n = t->ops;
+    uint64_t t0, t1, t2, rng = t->id + 1;
+
+    for (long i = 0; i < n; i++) {
+        int rd = read_op(t, &rng);
+        t0 = rdtsc();
+#if LOCK_DELEGATE
+        delegate(t, rd, node, 0);
+        t1 = t2 = rdtscp();
+#else
+        acquire(rd, node);
+        t1 = rdtscp();
+        critical_section(t, rd);
+        t2 = rdtscp();
+        release(rd, node);
+#endif
+        hist_add(t->acquire, t1 - t0);
+        hist_add(t->hold, t2 - t1);
+        think(t, &rng);
+    }
+}
+
+/* Time bounded loop. Counts acquisitions and tracks which thread got the lock
+ * last, so unfair locks letting one thread win repeatedly show up as long
+ * streaks. Readers may hold the lock together, only exclusive acquisitions
+ * update the streak. */
+static void inc_timed(struct bench_thread *t, lock_node_t *node) {
+    long n = 0, timeouts = 0;
+    uint64_t t0, t1, t2, wait, max_wait = 0, rng = t->id + 1;
 
-    if (argc != 2) {
-        printf("Usage: %s <num of threads>\n", argv[0]);
-        exit(1);
+    while (!*t->stop) {
+        int rd, p = 0;
+
+        if (t->phase) {
+            p = *t->phase;
+            if (t->id >= t->active[p]) {
+                phase_sleep();
+                continue;
+            }
+        }
+        rd = read_op(t, &rng);
+        t0 = rdtsc();
+#if LOCK_DELEGATE
+        /* Delegating locks have no timed acquire. */
+        delegate(t, rd, node, 1);
+        t1 = t2 = rdtscp();
+#else
+        if (!rd && timed_op(t, &rng)) {
+            if (!acquire_timeout(node, t->work->timeout)) {
+                timeouts++;
+                think(t, &rng);
+                continue;
+            }
+        } else {
+            acquire(rd, node);
+        }
+        t1 = rdtscp();
+        if (!rd)
+            fair_update(t);
+        critical_section(t, rd);
+        t2 = rdtscp();
+        release(rd, node);
+#endif
+
+        wait = t1 - t0;
+        if (wait > max_wait)
+            max_wait = wait;
+        if (t->acquire) {
+            hist_add(t->acquire, wait);
+            hist_add(t->hold, t2 - t1);
+        }
+        n++;
+        if (t->phase)
+            t->phase_acquired[p]++;
+        think(t, &rng);
     }
+    t->acquired = n;
+    t->timeouts = timeouts;
+    t->max_wait = max_wait;
+}
 
-    nthr = atoi(argv[1]);
-    /*printf("using %d threads\n", nthr);*/
-    thr = calloc(sizeof(*thr), nthr);
+static void *inc_thread(void *arg) {
+    struct bench_thread *t = arg;
+    long n = t->ops;
+    lock_node_t node;
+    uint64_t rng = t->id + 1;
 
-    // Start thread
-    for (long i = 0; i < nthr; i++) {
-        if (pthread_create(&thr[i], NULL, inc_thread, (void *)i) != 0) {
-            perror("thread creating failed");
+    lock_node_init(&node);
+    bench_thread_start(t);
+
+    if (t->stop) {
+        inc_timed(t, &node);
+    } else if (t->acquire) {
+        inc_latency(t, &node);
+    } else {
+        /* Start lock unlock test. */
+        for (long i = 0; i < n; i++) {
+            int rd = read_op(t, &rng);
+#if LOCK_DELEGATE
+            delegate(t, rd, &node, 0);
+#else
+            acquire(rd, &node);
+            critical_section(t, rd);
+            release(rd, &node);
+#endif
+            think(t, &rng);
         }
     }
-    // join thread
-    for (long i = 0; i < nthr; i++)
-        pthread_join(thr[i], NULL);
-
-    calc_time(&start_time, &end_time);
-    /*
-     *for (int i = 0; i < NCOUNTER; i++) {
-     *    if (counter[i] == N_PAIR) {
-     *    } else {
-     *        printf("counter %d error\n", i);
-     *        ret = 1;
-     *    }
-     *}
-     */
+    if (!t->stop)
+        t->acquired = n;
 
-    return ret;
+    bench_thread_end(t);
+    return NULL;
 }
+
+#define __BENCH_LOCK_SYM(id, suffix) bench_lock_##id##suffix
+#define BENCH_LOCK_SYM(id, suffix) __BENCH_LOCK_SYM(id, suffix)
+
+#ifdef LOCK_BACKOFF
+#define LOCK_BACKOFF_SYM NULL
+const struct bench_lock BENCH_LOCK_SYM(LOCK_ID, _bo) = {
+#else
+/* Weak, programs not linking the backoff objects get NULL. */
+extern const struct bench_lock BENCH_LOCK_SYM(LOCK_ID, _bo) __attribute__((weak));
+#define LOCK_BACKOFF_SYM &BENCH_LOCK_SYM(LOCK_ID, _bo)
+const struct bench_lock BENCH_LOCK_SYM(LOCK_ID, ) = {
+#endif
+    .name = LOCK_NAME,
+    .init = lock_init,
+    .thread = inc_thread,
+    .supported = LOCK_SUPPORTED,
+    .max_threads = LOCK_MAX_THREADS,
+    .timeout = LOCK_TIMEOUT,
+    .stats = LOCK_STATS,
+    .lock_size = sizeof(lock_t),
+    .node_size = sizeof(lock_node_t),
+    .lock_init = generic_lock_init,
+    .node_init = generic_node_init,
+    .acquire = generic_acquire,
+    .release = generic_release,
+    .acquire_read = generic_acquire_read,
+    .release_read = generic_release_read,
+    .execute = generic_execute,
+    .backoff = LOCK_BACKOFF_SYM,
+};
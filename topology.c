@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "topology.h"
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define SYSFS_NODE "/sys/devices/system/node"
+
+int parse_cpulist(const char *s, int *cpus, int max) {
+    int n = 0;
+
+    while (*s && *s != '\n') {
+        char *end;
+        long lo = strtol(s, &end, 10), hi;
+
+        if (end == s || lo < 0)
+            return -1;
+        hi = lo;
+        s = end;
+        if (*s == '-') {
+            hi = strtol(s + 1, &end, 10);
+            if (end == s + 1 || hi < lo)
+                return -1;
+            s = end;
+        }
+        for (long c = lo; c <= hi && n < max; c++)
+            cpus[n++] = c;
+        if (*s == ',')
+            s++;
+        else if (*s && *s != '\n')
+            return -1;
+    }
+    return n;
+}
+
+/* Read a single integer from a sysfs file, return def if missing. */
+static int read_int(const char *path, int def) {
+    FILE *f = fopen(path, "r");
+    int v;
+
+    if (!f)
+        return def;
+    if (fscanf(f, "%d", &v) != 1)
+        v = def;
+    fclose(f);
+    return v;
+}
+
+static char *read_line(const char *path, char *buf, int size) {
+    FILE *f = fopen(path, "r");
+    char *r;
+
+    if (!f)
+        return NULL;
+    r = fgets(buf, size, f);
+    fclose(f);
+    return r;
+}
+
+static int cmp_cpu(const void *a, const void *b) {
+    const struct cpu_info *x = a, *y = b;
+
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+/* Set cpu->node from /sys/devices/system/node/node<N>/cpulist. */
+static int load_nodes(struct topology *topo) {
+    DIR *d = opendir(SYSFS_NODE);
+    struct dirent *e;
+    char path[512], buf[4096];
+    int nnode = 0, max = topo->ncpu * 4 + 64;
+    int *cpus = malloc(max * sizeof(*cpus));
+
+    if (!d) {
+        free(cpus);
+        return 1;
+    }
+    while ((e = readdir(d)) != NULL) {
+        int node, n;
+
+        if (sscanf(e->d_name, "node%d", &node) != 1)
+            continue;
+        snprintf(path, sizeof(path), SYSFS_NODE "/%s/cpulist", e->d_name);
+        if (!read_line(path, buf, sizeof(buf)))
+            continue;
+        n = parse_cpulist(buf, cpus, max);
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < topo->ncpu; j++) {
+                if (topo->cpu[j].cpu == cpus[i])
+                    topo->cpu[j].node = node;
+            }
+        }
+        if (node + 1 > nnode)
+            nnode = node + 1;
+    }
+    closedir(d);
+    free(cpus);
+    return nnode ? nnode : 1;
+}
+
+int topology_load(struct topology *topo) {
+    char path[256], buf[4096];
+    int max = 4096, n;
+    int *cpus = malloc(max * sizeof(*cpus));
+
+    memset(topo, 0, sizeof(*topo));
+    if (read_line(SYSFS_CPU "/online", buf, sizeof(buf)))
+        n = parse_cpulist(buf, cpus, max);
+    else
+        n = -1;
+    if (n <= 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n <= 0 || n > max)
+            n = 1;
+        for (int i = 0; i < n; i++)
+            cpus[i] = i;
+    }
+
+    topo->ncpu = n;
+    topo->cpu = calloc(n, sizeof(*topo->cpu));
+    for (int i = 0; i < n; i++) {
+        struct cpu_info *c = &topo->cpu[i];
+
+        c->cpu = cpus[i];
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/physical_package_id", c->cpu);
+        c->package = read_int(path, 0);
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/core_id", c->cpu);
+        c->core = read_int(path, c->cpu);
+        if (c->package < 0)
+            c->package = 0;
+    }
+    free(cpus);
+
+    qsort(topo->cpu, n, sizeof(*topo->cpu), cmp_cpu);
+    for (int i = 0; i < n; i++) {
+        struct cpu_info *c = &topo->cpu[i];
+
+        if (i > 0 && c[-1].package == c->package && c[-1].core == c->core)
+            c->smt = c[-1].smt + 1;
+        if (c->package + 1 > topo->npackage)
+            topo->npackage = c->package + 1;
+    }
+    topo->nnode = load_nodes(topo);
+    return 0;
+}
+
+void topology_free(struct topology *topo) {
+    free(topo->cpu);
+    topo->cpu = NULL;
+}
+
+void topology_print(const struct topology *topo) {
+    printf("%d cpus, %d packages, %d numa nodes\n",
+           topo->ncpu, topo->npackage, topo->nnode);
+    printf("cpu\tpackage\tcore\tsmt\tnode\n");
+    for (int i = 0; i < topo->ncpu; i++) {
+        const struct cpu_info *c = &topo->cpu[i];
+        printf("%d\t%d\t%d\t%d\t%d\n", c->cpu, c->package, c->core, c->smt, c->node);
+    }
+}
+
+int topology_order(const struct topology *topo, enum placement policy, int *order) {
+    int n = 0, maxsmt = 0;
+
+    for (int i = 0; i < topo->ncpu; i++) {
+        if (topo->cpu[i].smt > maxsmt)
+            maxsmt = topo->cpu[i].smt;
+    }
+
+    switch (policy) {
+    case PLACE_COMPACT:
+        /* cpu[] is already sorted by package, core and sibling. */
+        for (int i = 0; i < topo->ncpu; i++)
+            order[n++] = topo->cpu[i].cpu;
+        break;
+    case PLACE_CORE:
+        for (int s = 0; s <= maxsmt; s++) {
+            for (int i = 0; i < topo->ncpu; i++) {
+                if (topo->cpu[i].smt == s)
+                    order[n++] = topo->cpu[i].cpu;
+            }
+        }
+        break;
+    case PLACE_SOCKET: {
+        /* Take the k-th core of every package in turn, siblings last. */
+        int *next = calloc(topo->npackage, sizeof(*next));
+        for (int s = 0; s <= maxsmt; s++) {
+            int progress = 1;
+            memset(next, 0, topo->npackage * sizeof(*next));
+            while (progress) {
+                progress = 0;
+                for (int p = 0; p < topo->npackage; p++) {
+                    int k = 0;
+                    for (int i = 0; i < topo->ncpu; i++) {
+                        const struct cpu_info *c = &topo->cpu[i];
+                        if (c->package != p || c->smt != s)
+                            continue;
+                        if (k++ == next[p]) {
+                            order[n++] = c->cpu;
+                            next[p]++;
+                            progress = 1;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+        free(next);
+        break;
+    }
+    default:
+        break;
+    }
+    return n;
+}
@@ -0,0 +1,45 @@
+#ifndef _TOPOLOGY_H
+#define _TOPOLOGY_H
+
+/* CPU topology read from /sys/devices/system/cpu and /sys/devices/system/node,
+ * used to place benchmark threads. */
+
+struct cpu_info {
+    int cpu;     /* Logical CPU id as used by sched_setaffinity. */
+    int package; /* Physical socket. */
+    int core;    /* Core id, unique only within a package. */
+    int node;    /* NUMA node, 0 if the kernel has no NUMA support. */
+    int smt;     /* Index of this hardware thread among its core's siblings. */
+};
+
+struct topology {
+    int ncpu;
+    int npackage;
+    int nnode;
+    struct cpu_info *cpu; /* Online CPUs sorted by (package, core, smt). */
+};
+
+enum placement {
+    PLACE_NONE,    /* Let the scheduler decide. */
+    PLACE_COMPACT, /* Fill SMT siblings of a core, then cores of a socket. */
+    PLACE_CORE,    /* One thread per physical core before using siblings. */
+    PLACE_SOCKET,  /* Round robin over sockets, one core at a time. */
+    PLACE_LIST,    /* Explicit CPU list. */
+};
+
+/* Return 0 on success. Falls back to a flat topology (every CPU its own core
+ * on package 0) when sysfs is not readable. */
+int topology_load(struct topology *topo);
+void topology_free(struct topology *topo);
+void topology_print(const struct topology *topo);
+
+/* Fill order with logical CPU ids in the order threads should be placed for
+ * the given policy. order must have room for topo->ncpu entries. Returns the
+ * number of CPUs written. */
+int topology_order(const struct topology *topo, enum placement policy, int *order);
+
+/* Parse a kernel style CPU list such as "0-3,8,10-11" into cpus. Returns the
+ * number of entries, or -1 on syntax error. */
+int parse_cpulist(const char *s, int *cpus, int max);
+
+#endif /* _TOPOLOGY_H */
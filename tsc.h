@@ -0,0 +1,50 @@
+#ifndef _TSC_H
+#define _TSC_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Time stamp counter helpers. Assumes an invariant TSC (constant_tsc and
+ * nonstop_tsc in /proc/cpuinfo), which holds on every x86 server built in the
+ * last decade. */
+
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* rdtscp waits for all previous instructions to execute, so it is used to
+ * take the timestamp after an operation completes. */
+static inline uint64_t rdtscp(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtscp" : "=a" (lo), "=d" (hi) : : "ecx", "memory");
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t tsc_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Return TSC ticks per nanosecond, measured against CLOCK_MONOTONIC over
+ * about 50ms. */
+static inline double tsc_calibrate(void)
+{
+    uint64_t ns0, ns1, c0, c1;
+
+    ns0 = tsc_clock_ns();
+    c0 = rdtsc();
+    do {
+        ns1 = tsc_clock_ns();
+    } while (ns1 - ns0 < 50000000);
+    c1 = rdtsc();
+
+    return (double)(c1 - c0) / (ns1 - ns0);
+}
+
+#endif /* _TSC_H */
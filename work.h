@@ -0,0 +1,57 @@
+#ifndef _WORK_H
+#define _WORK_H
+
+/* Helpers shared by the benchmarks: random numbers, the work outside the lock
+ * of the thread bodies in test-spinlock.c and counter.c, and run timing. */
+
+#include <stdint.h>
+#include <time.h>
+#include "bench.h"
+#include "tsc.h"
+
+/* Finalizer of MurmurHash3, spreads the bits of v over the whole word. */
+static inline uint64_t mix64(uint64_t v) {
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    v *= 0xc4ceb9fe1a85ec53ULL;
+    v ^= v >> 33;
+    return v;
+}
+
+static inline uint64_t xorshift64(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/* Busy work outside the lock. Random think time is uniform in
+ * [0, 2 * think] so the mean stays the same. */
+static inline void think(struct bench_thread *t, uint64_t *rng) {
+    uint64_t ticks = t->work->think;
+    uint64_t end;
+
+    if (!ticks)
+        return;
+    if (t->work->think_random)
+        ticks = xorshift64(rng) % (2 * ticks + 1);
+    end = rdtsc() + ticks;
+    while (rdtsc() < end)
+        ;
+}
+
+/* Threads not used in the current phase poll for the next one. */
+static inline void phase_sleep(void) {
+    struct timespec ts = { 0, 100000 };
+
+    nanosleep(&ts, NULL);
+}
+
+/* Seconds from start to end. */
+static inline double calc_time(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) +
+        (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+#endif /* _WORK_H */